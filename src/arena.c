@@ -0,0 +1,184 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Arenas for the buffers of a format. An arena is one reservation of
+ * address space handed out by bumping a pointer, backed by huge pages
+ * where the system has them, so that building thousands of cylinder
+ * groups makes no calls to malloc and touches few TLB entries. Each
+ * thread carves its allocations out of a slab of ARENASLAB bytes of its
+ * own, so that the threads of initcgs() do not contend for a lock.
+ *
+ * Memory is not given back one buffer at a time: arenafree() only
+ * frees what was allocated with aligned_alloc() because the arena was
+ * full or could not be mapped, and arenareset() recycles everything at
+ * once. An arena that is reset must not be allocated from by other
+ * threads at the same time.
+ */
+
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define	ARENASLAB	(2 * 1024 * 1024)	/* a huge page on most systems */
+#define	MAXARENAS	2
+
+struct arena {
+	int		 ar_id;		/* index of the slabs of each thread */
+	int		 ar_hugetlb;	/* try MAP_HUGETLB, reserving it all */
+	size_t		 ar_size;	/* bytes of address space reserved */
+	char		*ar_base;	/* NULL until the first allocation */
+	size_t		 ar_used;	/* bytes given to slabs */
+	uint32_t	 ar_gen;	/* bumped by arenareset() */
+	int		 ar_failed;	/* could not be mapped */
+	pthread_mutex_t	 ar_lock;
+};
+
+struct slab {
+	char		*sl_next;	/* next free byte */
+	char		*sl_end;
+	uint32_t	 sl_gen;	/* ar_gen when the slab was taken */
+};
+
+static __thread struct slab tslab[MAXARENAS];
+
+/*
+ * The buffers that live as long as a format does.
+ */
+struct arena fmtarena = { 0, 0, (size_t)1 << (sizeof(void *) == 8 ? 34 : 28),
+    NULL, 0, 1, 0, PTHREAD_MUTEX_INITIALIZER };
+
+#ifndef MPOL_PREFERRED
+#define	MPOL_PREFERRED	1
+#endif
+
+/*
+ * Map an arena. A small arena is first tried with MAP_HUGETLB, which
+ * reserves the pages up front and so fails cleanly when there are not
+ * enough; otherwise the address space is only reserved and transparent
+ * huge pages are asked for. Pages come from the NUMA node of the device
+ * while it has any.
+ */
+static void
+arenamap(struct arena *ar)
+{
+	void *p;
+
+	p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (ar->ar_hugetlb)
+		p = mmap(NULL, ar->ar_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (p == MAP_FAILED) {
+		p = mmap(NULL, ar->ar_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) {
+			ar->ar_failed = 1;
+			return;
+		}
+#ifdef MADV_HUGEPAGE
+		(void)madvise(p, ar->ar_size, MADV_HUGEPAGE);
+#endif
+	}
+#ifdef SYS_mbind
+	if (numanode >= 0 && numanode < 1024) {
+		unsigned long mask[1024 / (8 * sizeof(long))];
+
+		memset(mask, 0, sizeof(mask));
+		mask[numanode / (8 * sizeof(long))] |=
+		    1UL << (numanode % (8 * sizeof(long)));
+		(void)syscall(SYS_mbind, p, ar->ar_size, MPOL_PREFERRED, mask,
+		    1024UL, 0U);
+	}
+#endif
+	ar->ar_base = p;
+}
+
+/*
+ * Allocate size bytes aligned to LIBUFS_BUFALIGN. Memory that has not
+ * been used since the arena was mapped is zero; recycled memory is not.
+ */
+void *
+arenaalloc(struct arena *ar, size_t size)
+{
+	struct slab *sl;
+	size_t n;
+	void *p;
+
+	size = roundup(size, LIBUFS_BUFALIGN);
+	sl = &tslab[ar->ar_id];
+	if (sl->sl_gen != __atomic_load_n(&ar->ar_gen, __ATOMIC_ACQUIRE) ||
+	    sl->sl_next == NULL || (size_t)(sl->sl_end - sl->sl_next) < size) {
+		n = roundup(size, ARENASLAB);
+		pthread_mutex_lock(&ar->ar_lock);
+		if (ar->ar_base == NULL && !ar->ar_failed)
+			arenamap(ar);
+		p = NULL;
+		if (ar->ar_base != NULL && ar->ar_size - ar->ar_used >= n) {
+			p = ar->ar_base + ar->ar_used;
+			ar->ar_used += n;
+		}
+		pthread_mutex_unlock(&ar->ar_lock);
+		if (p == NULL) {
+			if ((p = aligned_alloc(LIBUFS_BUFALIGN, size)) == NULL)
+				errx(31, "aligned_alloc failed");
+			return (p);
+		}
+		sl->sl_next = p;
+		sl->sl_end = sl->sl_next + n;
+		sl->sl_gen = ar->ar_gen;
+	}
+	p = sl->sl_next;
+	sl->sl_next += size;
+	return (p);
+}
+
+/*
+ * Free a buffer of an arena, which only matters for one that did not
+ * fit in it.
+ */
+void
+arenafree(struct arena *ar, void *p)
+{
+
+	if (ar->ar_base == NULL || (char *)p < ar->ar_base ||
+	    (char *)p >= ar->ar_base + ar->ar_size)
+		free(p);
+}
+
+/*
+ * Recycle all of an arena, which must not be in use by another thread.
+ */
+void
+arenareset(struct arena *ar)
+{
+
+	pthread_mutex_lock(&ar->ar_lock);
+	ar->ar_used = 0;
+	__atomic_add_fetch(&ar->ar_gen, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ar->ar_lock);
+}
@@ -27,6 +27,8 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
+
 struct unionacg {
 	struct cg d_cg;
 	char d_buf[MAXBSIZE];
@@ -34,7 +36,8 @@ struct unionacg {
 struct unionacg d_acg;
 #define acg d_acg.d_cg
 
-int cgput(int devfd, struct fs *fs, struct cg *cgp)
+static int
+cgput1(int devfd, struct fs *fs, struct cg *cgp)
 {
 	size_t cnt;
 
@@ -44,8 +47,19 @@ int cgput(int devfd, struct fs *fs, struct cg *cgp)
 		    calculate_crc32c(~0L, (void *)cgp, fs->fs_cgsize);
 	}
 	failmsg = NULL;
-	if ((cnt = pwrite(devfd, cgp, fs->fs_cgsize,
-	    fsbtodb(fs, cgtod(fs, cgp->cg_cgx)) *
+	if (d_map != NULL) {
+		if (mapwrite((part_ofs + fsbtodb(fs, cgtod(fs, cgp->cg_cgx))) *
+		    (fs->fs_fsize / fsbtodb(fs,1)), cgp, fs->fs_cgsize) != 0) {
+			failmsg = "write beyond end of image";
+			return (-1);
+		}
+		return (0);
+	}
+	if (plan.wp_open)
+		return (planadd((part_ofs + fsbtodb(fs, cgtod(fs, cgp->cg_cgx))) *
+		    (fs->fs_fsize / fsbtodb(fs,1)), cgp, fs->fs_cgsize));
+	if ((cnt = dpwrite(devfd, cgp, fs->fs_cgsize,
+	    (part_ofs + fsbtodb(fs, cgtod(fs, cgp->cg_cgx))) *
 	    (fs->fs_fsize / fsbtodb(fs,1)))) < 0)
 		return (-1);
 	if (cnt != fs->fs_cgsize) {
@@ -56,11 +70,23 @@ int cgput(int devfd, struct fs *fs, struct cg *cgp)
 }
 
 int
-cgwrite()
+cgput(int devfd, struct fs *fs, struct cg *cgp)
+{
+	uint64_t start;
+	int error;
+
+	start = tracestart();
+	error = cgput1(devfd, fs, cgp);
+	trace("cgput", start, "cg", cgp->cg_cgx, "size", fs->fs_cgsize);
+	return (error);
+}
+
+int
+cgwrite1(struct cg *cgp)
 {
 
 		
-	if (cgput(d_fd, &sblock, &acg) == 0)
+	if (cgput(d_fd, &sblock, cgp) == 0)
 		return (0);
 	d_err = NULL;
 
@@ -81,6 +107,13 @@ cgwrite()
 
 }
 
+int
+cgwrite()
+{
+
+	return (cgwrite1(&acg));
+}
+
 
 /*
  * put a block into the map
@@ -107,27 +140,219 @@ setblock(struct fs *fs, unsigned char *cp, int h)
 	}
 }
 
+/*
+ * check if a block is available
+ */
+static int
+isblock(struct fs *fs, unsigned char *cp, int h)
+{
+	unsigned char mask;
+
+	switch (fs->fs_frag) {
+	case 8:
+		return (cp[h] == 0xff);
+	case 4:
+		mask = 0x0f << ((h & 0x1) << 2);
+		return ((cp[h >> 1] & mask) == mask);
+	case 2:
+		mask = 0x03 << ((h & 0x3) << 1);
+		return ((cp[h >> 2] & mask) == mask);
+	case 1:
+		mask = 0x01 << (h & 0x7);
+		return ((cp[h >> 3] & mask) == mask);
+	default:
+		fprintf(stderr, "isblock bad fs_frag %d\n", fs->fs_frag);
+		return (0);
+	}
+}
+
+/*
+ * Recompute the cluster summary of a cylinder group from its cluster map.
+ */
+static void
+clustersum(struct fs *fs, struct cg *cgp)
+{
+	int32_t *sump = cg_clustersum(cgp);
+	u_char *mapp = cg_clustersfree(cgp);
+	int map = *mapp++;
+	int bit = 1;
+	int run = 0;
+	uint i;
+
+	/*
+	 * The unused sump[0] overlaps the end of the block map.
+	 */
+	memset(&sump[1], 0, fs->fs_contigsumsize * sizeof(int32_t));
+	for (i = 0; i < cgp->cg_nclusterblks; i++) {
+		if ((map & bit) != 0)
+			run++;
+		else if (run != 0) {
+			if (run > fs->fs_contigsumsize)
+				run = fs->fs_contigsumsize;
+			sump[run]++;
+			run = 0;
+		}
+		if ((i & (CHAR_BIT - 1)) != CHAR_BIT - 1)
+			bit <<= 1;
+		else {
+			map = *mapp++;
+			bit = 1;
+		}
+	}
+	if (run != 0) {
+		if (run > fs->fs_contigsumsize)
+			run = fs->fs_contigsumsize;
+		sump[run]++;
+	}
+}
+
 
 
 /*
- * Initialize a cylinder group.
+ * Write the backup superblock of a cylinder group from a copy of sblock,
+ * made in a buffer kept by each thread. Only the struct fs part of it
+ * is ever written to, so the padding up to fs_sbsize stays zero.
  */
+static void
+sbbackup(int cylno)
+{
+	static __thread struct fs *sbbuf;
+	struct fs *fs;
+	off_t loc;
+
+	loc = fsbtodb(&sblock, cgsblock(&sblock, cylno)) * sectorsize;
+	if ((fs = mapaddr(part_ofs * sectorsize + loc, sblock.fs_sbsize)) !=
+	    NULL)
+		memset(fs, 0, sblock.fs_sbsize);
+	else {
+		if (sbbuf == NULL) {
+			sbbuf = arenaalloc(&fmtarena,
+			    MAX(sblock.fs_sbsize, sizeof(*fs)));
+			memset(sbbuf, 0, MAX(sblock.fs_sbsize, sizeof(*fs)));
+		}
+		fs = sbbuf;
+	}
+	memcpy(fs, &sblock, sizeof(*fs));
+	fs->fs_si = NULL;
+	fs->fs_sblockactualloc = loc;
+	if (ffs_sbput(&d_fd, fs, fs->fs_sblockactualloc) != 0)
+		err(1, "sbwrite:");
+}
+
+/*
+ * Fill in the generation numbers of "count" fresh inodes at "bp", the
+ * first of them inode "ino". The numbers are drawn INOBATCH at a time,
+ * so that the system generator is called once for a batch of inodes
+ * rather than once for each. Fresh inodes have a mode of zero and so
+ * no check hash.
+ */
+#define	INOBATCH	256
+
 void
-initcg(int cylno, time_t utime)
+inoblkbuild(char *bp, ino_t ino, int count)
+{
+	u_int32_t gen[INOBATCH];
+	struct ufs1_dinode *dp1;
+	struct ufs2_dinode *dp2;
+	int i, n;
+
+	dp1 = (struct ufs1_dinode *)bp;
+	dp2 = (struct ufs2_dinode *)bp;
+	for (; count > 0; count -= n) {
+		n = MIN(count, INOBATCH);
+		newfs_randoms(gen, ino, n);
+		ino += n;
+		if (sblock.fs_magic == FS_UFS1_MAGIC)
+			for (i = 0; i < n; i++)
+				(dp1++)->di_gen = gen[i];
+		else
+			for (i = 0; i < n; i++)
+				(dp2++)->di_gen = gen[i];
+	}
+}
+
+/*
+ * A pool of inode buffers of iobufsize bytes for initcg(), shared by
+ * the threads of initcgs(). inoblkbuild() changes nothing but the
+ * generation numbers, so a buffer taken from the pool is built again
+ * as it is, without being cleared first.
+ */
+static char **ibpool;
+static int ibnfree, ibnalloc;
+static pthread_mutex_t iblock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *
+ibget(void)
+{
+	char *ibuf;
+
+	pthread_mutex_lock(&iblock);
+	ibuf = ibnfree > 0 ? ibpool[--ibnfree] : NULL;
+	pthread_mutex_unlock(&iblock);
+	if (ibuf != NULL)
+		return (ibuf);
+	ibuf = arenaalloc(&fmtarena, iobufsize);
+	memset(ibuf, 0, iobufsize);
+	return (ibuf);
+}
+
+static void
+ibput(char *ibuf)
+{
+
+	pthread_mutex_lock(&iblock);
+	if (ibnfree == ibnalloc) {
+		ibnalloc = MAX(8, 2 * ibnalloc);
+		if ((ibpool = realloc(ibpool, ibnalloc * sizeof(*ibpool))) ==
+		    NULL)
+			errx(31, "realloc failed");
+	}
+	ibpool[ibnfree++] = ibuf;
+	pthread_mutex_unlock(&iblock);
+}
+
+/*
+ * The number of inodes initialized in each cylinder group: all of them
+ * for UFS1, and for UFS2 --prefill blocks of them, all with "full",
+ * the kernel initializing the rest as they are first allocated.
+ */
+static uint
+inoprefill(void)
+{
+
+	if (sblock.fs_magic == FS_UFS1_MAGIC || prefill < 0)
+		return (sblock.fs_ipg);
+	return (MIN((uint)prefill, sblock.fs_ipg / INOPB(&sblock)) *
+	    INOPB(&sblock));
+}
+
+/*
+ * Initialize a cylinder group in "cgp" and write it out, with its
+ * initialized inodes built and written iobufsize bytes at a time in
+ * "ibuf", which is all zeros but for any generation numbers. With a
+ * NULL "ibuf" they are built in place in the mapped image. Apart from
+ * fscs[cylno] nothing global is changed, so that several cylinder
+ * groups may be initialized at once.
+ */
+void
+initcg1(int cylno, time_t utime, struct cg *cgp, char *ibuf)
 {
 
 	long blkno, start;
-	off_t savedactualloc;
-	uint i, j, d, dlower, dupper;
+	uint i, d, dlower, dupper;
 	ufs2_daddr_t cbase, dmax;
-	struct ufs1_dinode *dp1;
-	struct ufs2_dinode *dp2;
 	struct csum *cs;
+	uint64_t tstart;
+	off_t off, size, len;
+	int inosize;
+	char *bp;
 
+	tstart = tracestart();
 	/*
 	 * Determine block bounds for cylinder group.
-	 * Allow space for super block summary information in first
-	 * cylinder group.
+	 * Allow space for super block summary information in the
+	 * cylinder group holding it, which is the first one unless
+	 * growfs has moved it.
 	 */
 	cbase = cgbase(&sblock, cylno);
 	dmax = cbase + sblock.fs_fpg;
@@ -135,55 +360,58 @@ initcg(int cylno, time_t utime)
 		dmax = sblock.fs_size;
 	dlower = cgsblock(&sblock, cylno) - cbase;
 	dupper = cgdmin(&sblock, cylno) - cbase;
-	if (cylno == 0)
+	if (cylno == dtog(&sblock, sblock.fs_csaddr))
 		dupper += howmany(sblock.fs_cssize, sblock.fs_fsize);
 	cs = &fscs[cylno];
-	memset(&acg, 0, sblock.fs_cgsize);
-	acg.cg_time = utime;
-	acg.cg_magic = CG_MAGIC;
-	acg.cg_cgx = cylno;
-	acg.cg_niblk = sblock.fs_ipg;
-	acg.cg_initediblk = MIN(sblock.fs_ipg, 2 * INOPB(&sblock));
-	acg.cg_ndblk = dmax - cbase;
+	memset(cgp, 0, sblock.fs_cgsize);
+	cgp->cg_time = utime;
+	cgp->cg_magic = CG_MAGIC;
+	cgp->cg_cgx = cylno;
+	cgp->cg_niblk = sblock.fs_ipg;
+	if (sblock.fs_magic == FS_UFS1_MAGIC)
+		cgp->cg_initediblk = MIN(sblock.fs_ipg, 2 * INOPB(&sblock));
+	else
+		cgp->cg_initediblk = inoprefill();
+	cgp->cg_ndblk = dmax - cbase;
 	if (sblock.fs_contigsumsize > 0)
-		acg.cg_nclusterblks = acg.cg_ndblk / sblock.fs_frag;
+		cgp->cg_nclusterblks = cgp->cg_ndblk / sblock.fs_frag;
 	start = sizeof(acg);
 	if (Oflag == 2) {
-		acg.cg_iusedoff = start;
+		cgp->cg_iusedoff = start;
 	} else {
-		acg.cg_old_ncyl = sblock.fs_old_cpg;
-		acg.cg_old_time = acg.cg_time;
-		acg.cg_time = 0;
-		acg.cg_old_niblk = acg.cg_niblk;
-		acg.cg_niblk = 0;
-		acg.cg_initediblk = 0;
-		acg.cg_old_btotoff = start;
-		acg.cg_old_boff = acg.cg_old_btotoff +
+		cgp->cg_old_ncyl = sblock.fs_old_cpg;
+		cgp->cg_old_time = cgp->cg_time;
+		cgp->cg_time = 0;
+		cgp->cg_old_niblk = cgp->cg_niblk;
+		cgp->cg_niblk = 0;
+		cgp->cg_initediblk = 0;
+		cgp->cg_old_btotoff = start;
+		cgp->cg_old_boff = cgp->cg_old_btotoff +
 		    sblock.fs_old_cpg * sizeof(int32_t);
-		acg.cg_iusedoff = acg.cg_old_boff +
+		cgp->cg_iusedoff = cgp->cg_old_boff +
 		    sblock.fs_old_cpg * sizeof(u_int16_t);
 	}
-	acg.cg_freeoff = acg.cg_iusedoff + howmany(sblock.fs_ipg, CHAR_BIT);
-	acg.cg_nextfreeoff = acg.cg_freeoff + howmany(sblock.fs_fpg, CHAR_BIT);
+	cgp->cg_freeoff = cgp->cg_iusedoff + howmany(sblock.fs_ipg, CHAR_BIT);
+	cgp->cg_nextfreeoff = cgp->cg_freeoff + howmany(sblock.fs_fpg, CHAR_BIT);
 	if (sblock.fs_contigsumsize > 0) {
-		acg.cg_clustersumoff =
-		    roundup(acg.cg_nextfreeoff, sizeof(u_int32_t));
-		acg.cg_clustersumoff -= sizeof(u_int32_t);
-		acg.cg_clusteroff = acg.cg_clustersumoff +
+		cgp->cg_clustersumoff =
+		    roundup(cgp->cg_nextfreeoff, sizeof(u_int32_t));
+		cgp->cg_clustersumoff -= sizeof(u_int32_t);
+		cgp->cg_clusteroff = cgp->cg_clustersumoff +
 		    (sblock.fs_contigsumsize + 1) * sizeof(u_int32_t);
-		acg.cg_nextfreeoff = acg.cg_clusteroff +
+		cgp->cg_nextfreeoff = cgp->cg_clusteroff +
 		    howmany(fragstoblks(&sblock, sblock.fs_fpg), CHAR_BIT);
 	}
-	if (acg.cg_nextfreeoff > (unsigned)sblock.fs_cgsize) {
+	if (cgp->cg_nextfreeoff > (unsigned)sblock.fs_cgsize) {
 		printf("Panic: cylinder group too big by %d bytes\n",
-		    acg.cg_nextfreeoff - (unsigned)sblock.fs_cgsize);
+		    cgp->cg_nextfreeoff - (unsigned)sblock.fs_cgsize);
 		exit(37);
 	}
-	acg.cg_cs.cs_nifree += sblock.fs_ipg;
+	cgp->cg_cs.cs_nifree += sblock.fs_ipg;
 	if (cylno == 0)
 		for (i = 0; i < (long)UFS_ROOTINO; i++) {
-			setbit(cg_inosused(&acg), i);
-			acg.cg_cs.cs_nifree--;
+			setbit(cg_inosused(cgp), i);
+			cgp->cg_cs.cs_nifree--;
 		}
 	if (cylno > 0) {
 		/*
@@ -192,105 +420,219 @@ initcg(int cylno, time_t utime)
 		 */
 		for (d = 0; d < dlower; d += sblock.fs_frag) {
 			blkno = d / sblock.fs_frag;
-			setblock(&sblock, cg_blksfree(&acg), blkno);
+			setblock(&sblock, cg_blksfree(cgp), blkno);
 			if (sblock.fs_contigsumsize > 0)
-				setbit(cg_clustersfree(&acg), blkno);
-			acg.cg_cs.cs_nbfree++;
+				setbit(cg_clustersfree(cgp), blkno);
+			cgp->cg_cs.cs_nbfree++;
 		}
 	}
 	if ((i = dupper % sblock.fs_frag)) {
-		acg.cg_frsum[sblock.fs_frag - i]++;
+		cgp->cg_frsum[sblock.fs_frag - i]++;
 		for (d = dupper + sblock.fs_frag - i; dupper < d; dupper++) {
-			setbit(cg_blksfree(&acg), dupper);
-			acg.cg_cs.cs_nffree++;
+			setbit(cg_blksfree(cgp), dupper);
+			cgp->cg_cs.cs_nffree++;
 		}
 	}
-	for (d = dupper; d + sblock.fs_frag <= acg.cg_ndblk;
+	for (d = dupper; d + sblock.fs_frag <= cgp->cg_ndblk;
 	     d += sblock.fs_frag) {
 		blkno = d / sblock.fs_frag;
-		setblock(&sblock, cg_blksfree(&acg), blkno);
+		setblock(&sblock, cg_blksfree(cgp), blkno);
 		if (sblock.fs_contigsumsize > 0)
-			setbit(cg_clustersfree(&acg), blkno);
-		acg.cg_cs.cs_nbfree++;
+			setbit(cg_clustersfree(cgp), blkno);
+		cgp->cg_cs.cs_nbfree++;
 	}
-	if (d < acg.cg_ndblk) {
-		acg.cg_frsum[acg.cg_ndblk - d]++;
-		for (; d < acg.cg_ndblk; d++) {
-			setbit(cg_blksfree(&acg), d);
-			acg.cg_cs.cs_nffree++;
+	if (d < cgp->cg_ndblk) {
+		cgp->cg_frsum[cgp->cg_ndblk - d]++;
+		for (; d < cgp->cg_ndblk; d++) {
+			setbit(cg_blksfree(cgp), d);
+			cgp->cg_cs.cs_nffree++;
 		}
 	}
-	if (sblock.fs_contigsumsize > 0) {
-		int32_t *sump = cg_clustersum(&acg);
-		u_char *mapp = cg_clustersfree(&acg);
-		int map = *mapp++;
-		int bit = 1;
-		int run = 0;
-
-		for (i = 0; i < acg.cg_nclusterblks; i++) {
-			if ((map & bit) != 0)
-				run++;
-			else if (run != 0) {
-				if (run > sblock.fs_contigsumsize)
-					run = sblock.fs_contigsumsize;
-				sump[run]++;
-				run = 0;
-			}
-			if ((i & (CHAR_BIT - 1)) != CHAR_BIT - 1)
-				bit <<= 1;
-			else {
-				map = *mapp++;
-				bit = 1;
-			}
-		}
-		if (run != 0) {
-			if (run > sblock.fs_contigsumsize)
-				run = sblock.fs_contigsumsize;
-			sump[run]++;
-		}
-	}
-	*cs = acg.cg_cs;
+	if (sblock.fs_contigsumsize > 0)
+		clustersum(&sblock, cgp);
+	*cs = cgp->cg_cs;
 	/*
 	 * Write out the duplicate super block. Then write the cylinder
-	 * group map and two blocks worth of inodes in a single write.
+	 * group map and its initialized inodes.
 	 */
-	savedactualloc = sblock.fs_sblockactualloc;
-	sblock.fs_sblockactualloc =
-	    (fsbtodb(&sblock, cgsblock(&sblock, cylno))) *sectorsize;
-
-	if (sbwrite(0) != 0)
-		err(1, "sbwrite:");
-	sblock.fs_sblockactualloc = savedactualloc;
-
-	if (cgwrite() != 0)
+	sbbackup(cylno);
+	if (cgwrite1(cgp) != 0)
 		err(1, "initcg: cgwrite: %s", d_err);
-	start = 0;
-	dp1 = (struct ufs1_dinode *)(&iobuf[start]);
-	dp2 = (struct ufs2_dinode *)(&iobuf[start]);
-	for (i = 0; i < acg.cg_initediblk; i++) {
-		if (sblock.fs_magic == FS_UFS1_MAGIC) {
-			dp1->di_gen = newfs_random();
-			dp1++;
-		} else {
-			dp2->di_gen = newfs_random();
-			dp2++;
+	inosize = sblock.fs_magic == FS_UFS1_MAGIC ?
+	    sizeof(struct ufs1_dinode) : sizeof(struct ufs2_dinode);
+	size = (off_t)inoprefill() * inosize;
+	for (off = 0; off < size; off += len) {
+		len = MIN(iobufsize, size - off);
+		if ((bp = ibuf) == NULL) {
+			if ((bp = mapaddr((part_ofs + fsbtodb(&sblock,
+			    cgimin(&sblock, cylno))) * sectorsize + off,
+			    len)) == NULL)
+				errx(36, "cg %d: beyond end of image", cylno);
+			memset(bp, 0, len);
 		}
+		inoblkbuild(bp, (ino_t)cylno * sblock.fs_ipg + off / inosize,
+		    len / inosize);
+		wtfs(fsbtodb(&sblock, cgimin(&sblock, cylno) +
+		    numfrags(&sblock, off)), len, bp);
 	}
-	wtfs(fsbtodb(&sblock, cgimin(&sblock, cylno)), iobufsize, iobuf);
-	/*
-	 * For the old file system, we have to initialize all the inodes.
-	 */
-	if (Oflag == 1) {
-		for (i = 2 * sblock.fs_frag;
-		     i < sblock.fs_ipg / INOPF(&sblock);
-		     i += sblock.fs_frag) {
-			dp1 = (struct ufs1_dinode *)(&iobuf[start]);
-			for (j = 0; j < INOPB(&sblock); j++) {
-				dp1->di_gen = newfs_random();
-				dp1++;
-			}
-			wtfs(fsbtodb(&sblock, cgimin(&sblock, cylno) + i),
-			    sblock.fs_bsize, &iobuf[start]);
+	trace("initcg", tstart, "cg", cylno, NULL, 0);
+}
+
+/*
+ * With --mmap a UFS2 cylinder group and its first inode blocks are
+ * built where they are in the image. The inode blocks of UFS1 are all
+ * made from the one buffer, so it stays in memory.
+ */
+void
+initcg(int cylno, time_t utime)
+{
+	struct cg *cgp;
+	char *ibuf;
+	off_t off;
+
+	if (d_map == NULL) {
+		ibuf = ibget();
+		initcg1(cylno, utime, &acg, ibuf);
+		ibput(ibuf);
+		return;
+	}
+	off = (part_ofs + fsbtodb(&sblock, cgsblock(&sblock, cylno))) *
+	    sectorsize;
+	mappopulate(off, (part_ofs + fsbtodb(&sblock, cgimin(&sblock, cylno)))
+	    * sectorsize + (Oflag == 1 ? 0 : (off_t)inoprefill() *
+	    sizeof(struct ufs2_dinode)) - off);
+	cgp = mapaddr((part_ofs + fsbtodb(&sblock, cgtod(&sblock, cylno))) *
+	    sectorsize, sblock.fs_cgsize);
+	if (cgp == NULL)
+		errx(36, "cg %d: beyond end of image", cylno);
+	ibuf = Oflag == 1 ? ibget() : NULL;
+	initcg1(cylno, utime, cgp, ibuf);
+	if (ibuf != NULL)
+		ibput(ibuf);
+}
+
+/*
+ * Initialize cylinder groups first through last - 1 with a thread for
+ * each processor, each with its own cylinder group and inode buffer,
+ * or building them in place with --mmap. The generation numbers of a
+ * reproducible image come from one sequence, taken in the order of
+ * the groups, so it is made by one thread.
+ */
+#define	MAXCGTHREADS	32
+
+static int cgnext, cglast;
+static time_t cgutime;
+
+static void *
+initcgworker(void *arg)
+{
+	char *ibuf;
+	struct cg *cgp;
+	int cylno;
+
+	if (d_map != NULL) {
+		while ((cylno = __atomic_fetch_add(&cgnext, 1,
+		    __ATOMIC_RELAXED)) < cglast)
+			initcg(cylno, cgutime);
+		return (arg);
+	}
+	cgp = arenaalloc(&fmtarena, sblock.fs_bsize);
+	ibuf = ibget();
+	while ((cylno = __atomic_fetch_add(&cgnext, 1, __ATOMIC_RELAXED)) <
+	    cglast)
+		initcg1(cylno, cgutime, cgp, ibuf);
+	ibput(ibuf);
+	arenafree(&fmtarena, cgp);
+	return (arg);
+}
+
+void
+initcgs(int first, int last, time_t utime)
+{
+	pthread_t threads[MAXCGTHREADS];
+	long nthreads;
+	int i, error;
+
+	cgnext = first;
+	cglast = last;
+	cgutime = utime;
+	nthreads = ncpus();
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXCGTHREADS, last - first)));
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, initcgworker,
+		    NULL)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
 		}
+	initcgworker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/*
+ * Sum the summary information of ncg cylinder groups into "total". With
+ * many groups they are split into slices of at least CSSLICE groups,
+ * each summed by a thread of its own, and the sums of the slices are
+ * then added pairwise, as a tree.
+ */
+#define	CSSLICE		65536
+
+struct csslice {
+	struct csum	*ss_cs;		/* first group of the slice */
+	int		 ss_n;		/* number of groups */
+	struct csum_total ss_total;	/* their sum */
+};
+
+static void *
+cssumworker(void *arg)
+{
+	struct csslice *ss;
+	int i;
+
+	ss = arg;
+	memset(&ss->ss_total, 0, sizeof(ss->ss_total));
+	for (i = 0; i < ss->ss_n; i++) {
+		ss->ss_total.cs_ndir += ss->ss_cs[i].cs_ndir;
+		ss->ss_total.cs_nbfree += ss->ss_cs[i].cs_nbfree;
+		ss->ss_total.cs_nifree += ss->ss_cs[i].cs_nifree;
+		ss->ss_total.cs_nffree += ss->ss_cs[i].cs_nffree;
 	}
+	return (arg);
+}
+
+void
+cssum(struct csum *cs, int ncg, struct csum_total *total)
+{
+	struct csslice slices[MAXCGTHREADS];
+	pthread_t threads[MAXCGTHREADS];
+	struct csum_total *t, *u;
+	long nthreads;
+	int i, step, error;
+
+	nthreads = ncpus();
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXCGTHREADS, ncg / CSSLICE)));
+	for (i = 0; i < nthreads; i++) {
+		slices[i].ss_cs = cs + (long)ncg * i / nthreads;
+		slices[i].ss_n = (long)ncg * (i + 1) / nthreads -
+		    (long)ncg * i / nthreads;
+	}
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, cssumworker,
+		    &slices[i])) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	cssumworker(&slices[0]);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	for (step = 1; step < nthreads; step *= 2)
+		for (i = 0; i + step < nthreads; i += 2 * step) {
+			t = &slices[i].ss_total;
+			u = &slices[i + step].ss_total;
+			t->cs_ndir += u->cs_ndir;
+			t->cs_nbfree += u->cs_nbfree;
+			t->cs_nifree += u->cs_nifree;
+			t->cs_nffree += u->cs_nffree;
+		}
+	*total = slices[0].ss_total;
 }
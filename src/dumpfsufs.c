@@ -0,0 +1,531 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * dumpfs.ufs: print the superblock, the summary information and the
+ * cylinder groups of a UFS file system, as text or as JSON.
+ */
+
+#define	_GNU_SOURCE
+
+#include <pthread.h>
+#include "trace.c"
+#include "crc32.c"
+#include "fs.h"
+#include "mkfsufs.h"
+#include "arena.c"
+#include "rate.c"
+#include "fault.c"
+#include "sparse.c"
+#include "plan.c"
+#include "sblock.c"
+
+/*
+ * Cylinder groups are read by several threads, a batch at a time, and
+ * printed in order once the batch is in.
+ */
+#define	MAXDUMPTHREADS	32
+#define	CGBATCH		1024
+
+static int json;		/* print JSON instead of text */
+static int summary;		/* leave out the maps */
+static char *cgbuf;		/* cylinder groups of the current batch */
+static int cgfirst, cglast;	/* cylinder groups of the current batch */
+static int cgnext;		/* next cylinder group to be read */
+static int *cgerror;		/* errno of a failed read or 0 */
+
+/*
+ * Fields are printed several to a line as text, or as members of
+ * nested objects and arrays as JSON.
+ */
+static int depth;		/* nesting of JSON objects and arrays */
+static int nfields[8];		/* fields printed at each level */
+
+static void
+psep(const char *name)
+{
+
+	if (json) {
+		printf("%s", nfields[depth]++ > 0 ? ", " : "");
+		if (name != NULL)
+			printf("\"%s\": ", name);
+	} else if (name != NULL)
+		printf("%s%s\t", nfields[depth]++ > 0 ? "\t" : "", name);
+	else
+		nfields[depth]++;
+}
+
+static void
+pnl(void)
+{
+
+	if (!json && nfields[depth] > 0)
+		printf("\n");
+	if (!json)
+		nfields[depth] = 0;
+}
+
+static void
+pint(const char *name, intmax_t val)
+{
+
+	psep(name);
+	printf("%jd", val);
+}
+
+static void
+phex(const char *name, uintmax_t val)
+{
+
+	psep(name);
+	printf(json ? "%ju" : "0x%jx", val);
+}
+
+static void
+pstr(const char *name, const char *val)
+{
+
+	psep(name);
+	if (!json) {
+		printf("%s", val);
+		return;
+	}
+	printf("\"");
+	for (; *val != '\0'; val++)
+		if (*val == '"' || *val == '\\')
+			printf("\\%c", *val);
+		else if ((unsigned char)*val < ' ')
+			printf("\\u%04x", *val);
+		else
+			putchar(*val);
+	printf("\"");
+}
+
+/*
+ * Start a JSON object or array, or a titled section of text.
+ */
+static void
+pbegin(const char *name, int c)
+{
+
+	if (json) {
+		psep(name);
+		printf("%c", c);
+	} else if (name != NULL) {
+		pnl();
+		printf("%s:\n", name);
+	}
+	nfields[++depth] = 0;
+}
+
+static void
+pend(int c)
+{
+
+	pnl();
+	depth--;
+	if (json)
+		printf("%c", c);
+}
+
+static const char *
+ptime(time_t t)
+{
+	static char buf[32];
+
+	strftime(buf, sizeof(buf), "%a %b %e %T %Y", localtime(&t));
+	return (buf);
+}
+
+/*
+ * Print the runs of set bits in a map.
+ */
+static void
+pranges(const char *name, u_char *map, int n)
+{
+	int i, first, col;
+
+	pbegin(name, '[');
+	for (i = 0, col = 0; i < n; i++) {
+		if (isclr(map, i))
+			continue;
+		for (first = i; i + 1 < n && isset(map, i + 1); )
+			i++;
+		if (json) {
+			psep(NULL);
+			printf("[%d, %d]", first, i);
+			continue;
+		}
+		if (col > 60) {
+			printf(",\n");
+			col = 0;
+		} else if (col > 0)
+			col += printf(", ");
+		if (col == 0)
+			col += printf("\t");
+		if (first == i)
+			col += printf("%d", i);
+		else
+			col += printf("%d-%d", first, i);
+	}
+	if (!json && col > 0)
+		printf("\n");
+	depth--;
+	if (json)
+		printf("]");
+}
+
+static void
+dumpsb(void)
+{
+	struct fs *fs;
+	char flags[160];
+	int i;
+
+	fs = &sblock;
+	pstr("magic", fs->fs_magic == FS_UFS2_MAGIC ? "UFS2" : "UFS1");
+	if (json)
+		pint("time", fs->fs_time);
+	else
+		pstr("time", ptime(fs->fs_time));
+	pnl();
+	pint("superblock location", fs->fs_sblockloc);
+	psep("id");
+	printf(json ? "[%u, %u]" : "[ %08x %08x ]", fs->fs_id[0], fs->fs_id[1]);
+	pnl();
+	pint("ncg", fs->fs_ncg);
+	pint("size", fs->fs_size);
+	pint("blocks", fs->fs_dsize);
+	pnl();
+	pint("bsize", fs->fs_bsize);
+	pint("shift", fs->fs_bshift);
+	phex("mask", (uint32_t)fs->fs_bmask);
+	pnl();
+	pint("fsize", fs->fs_fsize);
+	pint("shift", fs->fs_fshift);
+	phex("mask", (uint32_t)fs->fs_fmask);
+	pnl();
+	pint("frag", fs->fs_frag);
+	pint("shift", fs->fs_fragshift);
+	pint("fsbtodb", fs->fs_fsbtodb);
+	pnl();
+	pint("minfree", fs->fs_minfree);
+	pstr("optim", fs->fs_optim == FS_OPTSPACE ? "space" : "time");
+	pint("symlinklen", fs->fs_maxsymlinklen);
+	pnl();
+	pint("maxbsize", fs->fs_maxbsize);
+	pint("maxbpg", fs->fs_maxbpg);
+	pint("maxcontig", fs->fs_maxcontig);
+	pint("contigsumsize", fs->fs_contigsumsize);
+	pnl();
+	pint("nbfree", fs->fs_cstotal.cs_nbfree);
+	pint("ndir", fs->fs_cstotal.cs_ndir);
+	pint("nifree", fs->fs_cstotal.cs_nifree);
+	pint("nffree", fs->fs_cstotal.cs_nffree);
+	pnl();
+	pint("bpg", fragstoblks(fs, fs->fs_fpg));
+	pint("fpg", fs->fs_fpg);
+	pint("ipg", fs->fs_ipg);
+	pint("unrefs", fs->fs_unrefs);
+	pnl();
+	pint("nindir", fs->fs_nindir);
+	pint("inopb", fs->fs_inopb);
+	pint("maxfilesize", fs->fs_maxfilesize);
+	pnl();
+	pint("sbsize", fs->fs_sbsize);
+	pint("cgsize", fs->fs_cgsize);
+	pint("csaddr", fs->fs_csaddr);
+	pint("cssize", fs->fs_cssize);
+	pnl();
+	pint("sblkno", fs->fs_sblkno);
+	pint("cblkno", fs->fs_cblkno);
+	pint("iblkno", fs->fs_iblkno);
+	pint("dblkno", fs->fs_dblkno);
+	pnl();
+	pint("cgrotor", fs->fs_cgrotor);
+	pint("fmod", fs->fs_fmod);
+	pint("ronly", fs->fs_ronly);
+	pint("clean", fs->fs_clean);
+	pnl();
+	pint("metaspace", fs->fs_metaspace);
+	pint("avgfpdir", fs->fs_avgfpdir);
+	pint("avgfilesize", fs->fs_avgfilesize);
+	pnl();
+	flags[0] = '\0';
+	if (fs->fs_flags & FS_UNCLEAN)
+		strcat(flags, "unclean ");
+	if (fs->fs_flags & FS_DOSOFTDEP)
+		strcat(flags, "soft-updates ");
+	if (fs->fs_flags & FS_NEEDSFSCK)
+		strcat(flags, "needs-fsck-run ");
+	if (fs->fs_flags & FS_SUJ)
+		strcat(flags, "soft-updates+journal ");
+	if (fs->fs_flags & FS_ACLS)
+		strcat(flags, "acls ");
+	if (fs->fs_flags & FS_MULTILABEL)
+		strcat(flags, "multilabel ");
+	if (fs->fs_flags & FS_GJOURNAL)
+		strcat(flags, "gjournal ");
+	if (fs->fs_flags & FS_NFS4ACLS)
+		strcat(flags, "nfsv4acls ");
+	if (fs->fs_flags & FS_METACKHASH)
+		strcat(flags, "metadata-check-hashes ");
+	if (fs->fs_flags & FS_TRIM)
+		strcat(flags, "trim ");
+	if ((i = strlen(flags)) > 0)
+		flags[i - 1] = '\0';
+	pstr("flags", flags);
+	pnl();
+	flags[0] = '\0';
+	if (fs->fs_metackhash & CK_SUPERBLOCK)
+		strcat(flags, "superblock ");
+	if (fs->fs_metackhash & CK_CYLGRP)
+		strcat(flags, "cylinder-groups ");
+	if (fs->fs_metackhash & CK_INODE)
+		strcat(flags, "inodes ");
+	if ((i = strlen(flags)) > 0)
+		flags[i - 1] = '\0';
+	pstr("check hashes", flags);
+	pnl();
+	pstr("fsmnt", (char *)fs->fs_fsmnt);
+	pnl();
+	pstr("volname", (char *)fs->fs_volname);
+	pint("swuid", fs->fs_swuid);
+	pint("providersize", fs->fs_providersize);
+	pnl();
+}
+
+static void
+dumpcs(void)
+{
+	uint i;
+
+	pbegin(json ? "cs" : "cs[].cs_(nbfree,ndir,nifree,nffree)", '[');
+	for (i = 0; i < sblock.fs_ncg; i++) {
+		psep(NULL);
+		if (json) {
+			printf("[%d, %d, %d, %d]", fscs[i].cs_nbfree,
+			    fscs[i].cs_ndir, fscs[i].cs_nifree, fscs[i].cs_nffree);
+			continue;
+		}
+		if (i % 4 == 0)
+			printf("\t");
+		printf("(%d,%d,%d,%d) ", fscs[i].cs_nbfree, fscs[i].cs_ndir,
+		    fscs[i].cs_nifree, fscs[i].cs_nffree);
+		if (i % 4 == 3 || i == sblock.fs_ncg - 1)
+			printf("\n");
+	}
+	nfields[depth] = 0;
+	pend(']');
+}
+
+static void
+dumpcg(int cylno, struct cg *cgp)
+{
+	char title[32];
+	uint32_t ckhash;
+	int i, sum;
+
+	snprintf(title, sizeof(title), "cg %d", cylno);
+	pbegin(json ? NULL : title, '{');
+	if (cgerror[cylno - cgfirst] != 0) {
+		pstr("error", strerror(cgerror[cylno - cgfirst]));
+		pend('}');
+		return;
+	}
+	if (cgp->cg_magic != CG_MAGIC) {
+		pint("cgx", cylno);
+		pstr("error", "bad magic number");
+		pend('}');
+		return;
+	}
+	phex("magic", cgp->cg_magic);
+	pint("tell", lfragtosize(&sblock, cgtod(&sblock, cylno)));
+	if (json)
+		pint("time", sblock.fs_magic == FS_UFS2_MAGIC ? cgp->cg_time :
+		    cgp->cg_old_time);
+	else
+		pstr("time", ptime(sblock.fs_magic == FS_UFS2_MAGIC ?
+		    cgp->cg_time : cgp->cg_old_time));
+	pnl();
+	pint("cgx", cgp->cg_cgx);
+	pint("ndblk", cgp->cg_ndblk);
+	pint("niblk", sblock.fs_magic == FS_UFS2_MAGIC ? cgp->cg_niblk :
+	    cgp->cg_old_niblk);
+	pint("initiblk", cgp->cg_initediblk);
+	pint("unrefs", cgp->cg_unrefs);
+	pnl();
+	pint("nbfree", cgp->cg_cs.cs_nbfree);
+	pint("ndir", cgp->cg_cs.cs_ndir);
+	pint("nifree", cgp->cg_cs.cs_nifree);
+	pint("nffree", cgp->cg_cs.cs_nffree);
+	pnl();
+	pint("rotor", cgp->cg_rotor);
+	pint("irotor", cgp->cg_irotor);
+	pint("frotor", cgp->cg_frotor);
+	pnl();
+	if ((sblock.fs_metackhash & CK_CYLGRP) != 0) {
+		ckhash = cgp->cg_ckhash;
+		cgp->cg_ckhash = 0;
+		phex("ckhash", ckhash);
+		pstr("ckhash status", calculate_crc32c(~0L, (void *)cgp,
+		    sblock.fs_cgsize) == ckhash ? "ok" : "bad");
+		cgp->cg_ckhash = ckhash;
+		pnl();
+	}
+	pbegin("frsum", '[');
+	for (i = 1, sum = 0; i < sblock.fs_frag; i++) {
+		psep(NULL);
+		printf(json ? "%d" : "\t%d", cgp->cg_frsum[i]);
+		sum += cgp->cg_frsum[i] * i;
+	}
+	pend(']');
+	if (!json)
+		printf("sum of frsum: %d\n", sum);
+	if (sblock.fs_contigsumsize > 0) {
+		snprintf(title, sizeof(title), "clusters 1-%d+",
+		    sblock.fs_contigsumsize);
+		pbegin(json ? "clusters" : title, '[');
+		for (i = 1; i <= sblock.fs_contigsumsize; i++) {
+			psep(NULL);
+			printf(json ? "%d" : "\t%d", cg_clustersum(cgp)[i]);
+		}
+		pend(']');
+	}
+	if (!summary) {
+		pranges("inodes used", cg_inosused(cgp), sblock.fs_ipg);
+		pranges("blks free", cg_blksfree(cgp), cgp->cg_ndblk);
+	}
+	pend('}');
+}
+
+static void *
+dumpworker(void *arg)
+{
+	int cylno;
+
+	(void)arg;
+	while ((cylno = __atomic_fetch_add(&cgnext, 1, __ATOMIC_RELAXED)) <
+	    cglast)
+		if (bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, cylno)),
+		    &cgbuf[(size_t)(cylno - cgfirst) * sblock.fs_cgsize],
+		    sblock.fs_cgsize) == -1)
+			cgerror[cylno - cgfirst] = errno != 0 ? errno : EIO;
+		else
+			cgerror[cylno - cgfirst] = 0;
+	return (NULL);
+}
+
+static void
+dumpcgs(void)
+{
+	pthread_t threads[MAXDUMPTHREADS];
+	long nthreads;
+	int i, cylno, error;
+
+	nthreads = ncpus();
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXDUMPTHREADS,
+	    (long)sblock.fs_ncg)));
+	if ((cgbuf = aligned_alloc(LIBUFS_BUFALIGN,
+	    (size_t)CGBATCH * sblock.fs_cgsize)) == NULL ||
+	    (cgerror = calloc(CGBATCH, sizeof(*cgerror))) == NULL)
+		errx(1, "malloc failed");
+	pbegin(json ? "cgs" : NULL, '[');
+	for (cgfirst = 0; cgfirst < (int)sblock.fs_ncg; cgfirst = cglast) {
+		cglast = MIN(cgfirst + CGBATCH, (int)sblock.fs_ncg);
+		cgnext = cgfirst;
+		for (i = 1; i < nthreads; i++)
+			if ((error = pthread_create(&threads[i], NULL,
+			    dumpworker, NULL)) != 0) {
+				errno = error;
+				err(1, "pthread_create");
+			}
+		dumpworker(NULL);
+		for (i = 1; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		for (cylno = cgfirst; cylno < cglast; cylno++) {
+			if (!json)
+				printf("\n");
+			dumpcg(cylno, (struct cg *)&cgbuf[(size_t)(cylno -
+			    cgfirst) * sblock.fs_cgsize]);
+		}
+	}
+	depth--;
+	if (json)
+		printf("]");
+	free(cgbuf);
+	free(cgerror);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: dumpfs.ufs [-js] special-device\n");
+	fprintf(stderr, "\t-j print JSON\n");
+	fprintf(stderr, "\t-s print summaries only, without maps\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch;
+
+	while ((ch = getopt(argc, argv, "js")) != -1) {
+		switch (ch) {
+		case 'j':
+			json = 1;
+			break;
+		case 's':
+			summary = 1;
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	d_name = argv[0];
+	if ((d_fd = open(d_name, O_RDONLY)) < 0)
+		err(1, "%s", d_name);
+	sectorsize = DEV_BSIZE;
+	if (sbread() != 0)
+		errx(1, "%s: %s", d_name, d_err);
+	if (json)
+		printf("{");
+	pbegin(json ? "superblock" : NULL, '{');
+	dumpsb();
+	pend('}');
+	dumpcs();
+	dumpcgs();
+	if (json)
+		printf("}\n");
+	close(d_fd);
+	return (0);
+}
@@ -0,0 +1,448 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * expand.ufs: write a sparse image made by mkfs.ufs --sparse to a
+ * device or file.
+ *
+ * The extents of the image are gathered into writes of up to
+ * EXPANDMAX bytes, which are issued by several threads at once, with
+ * direct I/O where they are aligned to the sector size. Only what the
+ * image holds is written; the rest of the device is left alone, as it
+ * would be by mkfs.ufs. The data of every extent is checked against
+ * its CRC32C before it is written, and with -N that is all that is done.
+ *
+ * A stream, from mkfs.ufs --sparse size -, is read from standard input
+ * when the image is -, and is applied as it comes in, in order.
+ */
+
+#include <stdarg.h>
+
+#include "trace.c"
+#include "crc32.c"
+#include "fs.h"
+#include "mkfsufs.h"
+#include "arena.c"
+#include "rate.c"
+#include "fault.c"
+#include "sparse.c"
+#include "plan.c"
+#include "sblock.c"
+
+#define	EXPANDMAX		(8 * 1024 * 1024)
+#define	MAXEXPANDTHREADS	32
+
+/*
+ * A write of one or more adjacent extents, or of a piece of an extent
+ * of zeros.
+ */
+struct xwrite {
+	uint64_t	 xw_off;	/* offset on the device */
+	uint64_t	 xw_len;	/* length in bytes */
+	size_t		 xw_first;	/* first extent */
+	size_t		 xw_next;	/* number of extents */
+};
+
+static struct sparseext *xext;	/* table of extents of the image */
+static struct xwrite *xwrites;
+static size_t nxwrites;
+static size_t xnext;		/* next write to be issued */
+static size_t xbufsize;		/* size of the buffer of each thread */
+static int xfd;			/* the sparse image */
+static int dfd;			/* the device, buffered */
+static int ddfd = -1;		/* the device, for direct I/O */
+static int dsecsize;		/* sector size of the device */
+static int xerror;		/* first error, as exit status */
+static const char *xname;
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: expand.ufs [-N] [-j jobs] image device\n");
+	exit(2);
+}
+
+static void
+xfail(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+	__atomic_compare_exchange_n(&xerror, &(int){ 0 }, 1, 0,
+	    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+static void *
+expandworker(void *arg)
+{
+	struct sparseext *se;
+	struct xwrite *xw;
+	char *buf, *p;
+	size_t w, i;
+	int fd;
+
+	if ((buf = aligned_alloc(LIBUFS_BUFALIGN * 32, xbufsize)) == NULL)
+		errx(31, "aligned_alloc failed");
+	while (__atomic_load_n(&xerror, __ATOMIC_RELAXED) == 0 &&
+	    (w = __atomic_fetch_add(&xnext, 1, __ATOMIC_RELAXED)) <
+	    nxwrites) {
+		xw = &xwrites[w];
+		p = buf;
+		for (i = 0; i < xw->xw_next; i++) {
+			se = &xext[xw->xw_first + i];
+			if (se->se_data == SPARSE_ZERO) {
+				memset(p, 0, MIN(se->se_len, xw->xw_len));
+				p += MIN(se->se_len, xw->xw_len);
+				continue;
+			}
+			if (pread(xfd, p, se->se_len, se->se_data) !=
+			    (ssize_t)se->se_len) {
+				xfail("%s: can't read extent at %ju", xname,
+				    (uintmax_t)se->se_off);
+				break;
+			}
+			if (sparsecrc(p, se->se_len) != se->se_crc) {
+				xfail("%s: bad CRC of extent at %ju", xname,
+				    (uintmax_t)se->se_off);
+				break;
+			}
+			p += se->se_len;
+		}
+		if (i < xw->xw_next || Nflag)
+			continue;
+		fd = dfd;
+		if (ddfd >= 0 && xw->xw_off % dsecsize == 0 &&
+		    xw->xw_len % dsecsize == 0)
+			fd = ddfd;
+		if (pwrite(fd, buf, xw->xw_len, xw->xw_off) !=
+		    (ssize_t)xw->xw_len)
+			xfail("write of %ju bytes at %ju failed: %s",
+			    (uintmax_t)xw->xw_len, (uintmax_t)xw->xw_off,
+			    strerror(errno));
+	}
+	free(buf);
+	return (arg);
+}
+
+/*
+ * Read and check the header, trailer and table of the image, returning
+ * the size of the image and the number of extents.
+ */
+static uint64_t
+readimage(struct sparsehdr *shp, size_t *nextp)
+{
+	struct sparsetrailer st;
+	struct stat sb;
+	uint64_t size, end, table, tsize;
+	size_t i, n;
+
+	if (fstat(xfd, &sb) == -1)
+		err(1, "%s", xname);
+	if (!S_ISREG(sb.st_mode))
+		errx(1, "%s: a sparse image must be a file", xname);
+	if (sb.st_size < SPARSE_HDRSIZE + (off_t)sizeof(st) ||
+	    pread(xfd, &st, sizeof(st), sb.st_size - sizeof(st)) !=
+	    sizeof(st) ||
+	    memcmp(st.st_magic, SPARSE_EMAGIC, sizeof(st.st_magic)) != 0 ||
+	    le32toh(st.st_crc) != sparsecrc(&st, offsetof(struct sparsetrailer,
+	    st_crc)))
+		errx(1, "%s: sparse image is truncated", xname);
+	size = le64toh(shp->sh_size);
+	table = le64toh(st.st_table);
+	n = le64toh(st.st_next);
+	tsize = n * sizeof(*xext);
+	if (n > SIZE_MAX / sizeof(*xext) || table < SPARSE_HDRSIZE ||
+	    table + tsize != (uint64_t)sb.st_size - sizeof(st))
+		errx(1, "%s: bad table of extents", xname);
+	if ((xext = malloc(MAX(tsize, 1))) == NULL)
+		errx(31, "malloc failed");
+	if (pread(xfd, xext, tsize, table) != (ssize_t)tsize ||
+	    sparsecrc(xext, tsize) != le32toh(st.st_tablecrc))
+		errx(1, "%s: bad table of extents", xname);
+	for (end = 0, i = 0; i < n; i++) {
+		xext[i].se_off = le64toh(xext[i].se_off);
+		xext[i].se_len = le64toh(xext[i].se_len);
+		xext[i].se_data = le64toh(xext[i].se_data);
+		xext[i].se_crc = le32toh(xext[i].se_crc);
+		if (xext[i].se_off < end || xext[i].se_len == 0 ||
+		    xext[i].se_off + xext[i].se_len > size ||
+		    (xext[i].se_data != SPARSE_ZERO &&
+		    (xext[i].se_data < SPARSE_HDRSIZE ||
+		    xext[i].se_data + xext[i].se_len > table)))
+			errx(1, "%s: bad extent %zu", xname, i);
+		end = xext[i].se_off + xext[i].se_len;
+	}
+	*nextp = n;
+	return (size);
+}
+
+/*
+ * Gather the extents into writes. Extents with data are not split, so
+ * that their CRC can be checked; a buffer holds the largest of them.
+ */
+static void
+planwrites(size_t n)
+{
+	struct xwrite *xw;
+	struct sparseext *se;
+	uint64_t off, len;
+	size_t i, maxw;
+
+	maxw = 0;
+	xbufsize = EXPANDMAX;
+	for (i = 0; i < n; i++) {
+		if (xext[i].se_data == SPARSE_ZERO)
+			maxw += howmany(xext[i].se_len, EXPANDMAX);
+		else
+			xbufsize = MAX(xbufsize, roundup(xext[i].se_len,
+			    LIBUFS_BUFALIGN * 32));
+		maxw++;
+	}
+	if ((xwrites = calloc(MAX(maxw, 1), sizeof(*xwrites))) == NULL)
+		errx(31, "calloc failed");
+	xw = NULL;
+	for (i = 0; i < n; i++) {
+		se = &xext[i];
+		for (off = 0; off < se->se_len; off += len) {
+			len = se->se_len - off;
+			if (se->se_data == SPARSE_ZERO)
+				len = MIN(len, EXPANDMAX);
+			if (xw != NULL && off == 0 &&
+			    xw->xw_off + xw->xw_len == se->se_off &&
+			    xw->xw_len + len <= xbufsize &&
+			    xw->xw_len + len <= EXPANDMAX) {
+				xw->xw_len += len;
+				xw->xw_next++;
+				continue;
+			}
+			xw = &xwrites[nxwrites++];
+			xw->xw_off = se->se_off + off;
+			xw->xw_len = len;
+			xw->xw_first = i;
+			xw->xw_next = 1;
+		}
+	}
+}
+
+static int
+readall(int fd, void *buf, size_t size)
+{
+	char *p;
+	ssize_t n;
+
+	for (p = buf; size > 0; p += n, size -= n)
+		if ((n = read(fd, p, size)) <= 0)
+			return (-1);
+	return (0);
+}
+
+static void
+xflush(char *buf, uint64_t off, size_t len)
+{
+	int fd;
+
+	if (len == 0 || Nflag)
+		return;
+	fd = dfd;
+	if (ddfd >= 0 && off % dsecsize == 0 && len % dsecsize == 0)
+		fd = ddfd;
+	if (pwrite(fd, buf, len, off) != (ssize_t)len)
+		err(1, "write of %zu bytes at %ju failed", len, (uintmax_t)off);
+}
+
+/*
+ * Apply a stream. Records must come in ascending order of offset and
+ * not overlap; adjacent ones are gathered into writes of up to
+ * EXPANDMAX bytes.
+ */
+static void
+expandstream(uint64_t size, size_t *nextp)
+{
+	struct sparserec sr;
+	uint64_t off, len, end, total, bufoff;
+	uint32_t crc;
+	size_t n, buflen, next;
+	char *buf;
+
+	if ((buf = aligned_alloc(LIBUFS_BUFALIGN * 32, EXPANDMAX)) == NULL)
+		errx(31, "aligned_alloc failed");
+	bufoff = buflen = 0;
+	end = total = 0;
+	for (next = 0; ; next++) {
+		if (readall(xfd, &sr, sizeof(sr)) != 0)
+			errx(1, "%s: stream is truncated", xname);
+		off = le64toh(sr.sr_off);
+		len = le64toh(sr.sr_len);
+		if ((le32toh(sr.sr_flags) & SR_END) != 0) {
+			if (off != next || len != total)
+				errx(1, "%s: stream is incomplete", xname);
+			break;
+		}
+		if (off < end || len == 0 || off + len > size)
+			errx(1, "%s: bad record %zu", xname, next);
+		if (bufoff + buflen != off) {
+			xflush(buf, bufoff, buflen);
+			bufoff = off;
+			buflen = 0;
+		}
+		crc = ~0U;
+		for (end = off + len; off < end; off += n) {
+			if (buflen == EXPANDMAX) {
+				xflush(buf, bufoff, buflen);
+				bufoff = off;
+				buflen = 0;
+			}
+			n = MIN(end - off, EXPANDMAX - buflen);
+			if ((le32toh(sr.sr_flags) & SR_ZERO) != 0) {
+				memset(&buf[buflen], 0, n);
+			} else {
+				if (readall(xfd, &buf[buflen], n) != 0)
+					errx(1, "%s: stream is truncated",
+					    xname);
+				crc = calculate_crc32c(crc,
+				    (unsigned char *)&buf[buflen], n);
+			}
+			buflen += n;
+		}
+		if ((le32toh(sr.sr_flags) & SR_ZERO) == 0) {
+			if ((crc ^ ~0U) != le32toh(sr.sr_crc))
+				errx(1, "%s: bad CRC of record %zu", xname,
+				    next);
+			total += len;
+		}
+	}
+	xflush(buf, bufoff, buflen);
+	free(buf);
+	*nextp = next;
+}
+
+/*
+ * Open the device to be written and check that the image fits.
+ */
+static void
+opendev(const char *name, uint64_t size)
+{
+	struct stat sb;
+	uint64_t devsize;
+
+	if ((dfd = open(name, O_RDWR)) < 0)
+		err(1, "%s", name);
+	if (fstat(dfd, &sb) == -1)
+		err(1, "%s", name);
+	if (S_ISREG(sb.st_mode)) {
+		if ((uint64_t)sb.st_size < size && ftruncate(dfd, size) == -1)
+			err(1, "%s", name);
+		devsize = size;
+	} else if (ioctl(dfd, BLKGETSIZE64, &devsize) == -1)
+		err(1, "%s: can't get media size", name);
+	if (devsize < size)
+		errx(1, "%s: %ju bytes is smaller than the image, %ju",
+		    name, (uintmax_t)devsize, (uintmax_t)size);
+	if (ioctl(dfd, BLKSSZGET, &dsecsize) == -1 || dsecsize <= 0)
+		dsecsize = DEV_BSIZE;
+#ifdef O_DIRECT
+	ddfd = open(name, O_RDWR | O_DIRECT);
+#endif
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t threads[MAXEXPANDTHREADS];
+	struct sparsehdr sh;
+	uint64_t size;
+	size_t n, i;
+	long nthreads;
+	int ch, error;
+
+	nthreads = ncpus();
+	while ((ch = getopt(argc, argv, "Nj:")) != -1)
+		switch (ch) {
+		case 'N':
+			Nflag = 1;
+			break;
+		case 'j':
+			if ((nthreads = atoi(optarg)) <= 0)
+				errx(2, "%s: bad number of jobs", optarg);
+			break;
+		default:
+			usage();
+		}
+	argc -= optind;
+	argv += optind;
+	if (argc != 2)
+		usage();
+	xname = argv[0];
+	if (strcmp(xname, "-") == 0)
+		xfd = STDIN_FILENO;
+	else if ((xfd = open(xname, O_RDONLY)) < 0)
+		err(1, "%s", xname);
+	if (readall(xfd, &sh, sizeof(sh)) != 0 ||
+	    (memcmp(sh.sh_magic, SPARSE_MAGIC, sizeof(sh.sh_magic)) != 0 &&
+	    memcmp(sh.sh_magic, SPARSE_SMAGIC, sizeof(sh.sh_magic)) != 0) ||
+	    le32toh(sh.sh_crc) != sparsecrc(&sh, offsetof(struct sparsehdr,
+	    sh_crc)))
+		errx(1, "%s: not a sparse image", xname);
+	if (le32toh(sh.sh_version) != SPARSE_VERSION)
+		errx(1, "%s: version %u of sparse image is not supported",
+		    xname, le32toh(sh.sh_version));
+	size = le64toh(sh.sh_size);
+
+	if (memcmp(sh.sh_magic, SPARSE_SMAGIC, sizeof(sh.sh_magic)) == 0) {
+		if (!Nflag)
+			opendev(argv[1], size);
+		expandstream(size, &n);
+		if (!Nflag && fsync(dfd) == -1)
+			err(1, "%s: fsync", argv[1]);
+		fprintf(stderr, "%s: %zu records of %ju bytes\n", xname, n,
+		    (uintmax_t)size);
+		return (0);
+	}
+	readimage(&sh, &n);
+	planwrites(n);
+	if (!Nflag)
+		opendev(argv[1], size);
+
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXEXPANDTHREADS,
+	    (long)MAX(nxwrites, 1))));
+	for (i = 1; i < (size_t)nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, expandworker,
+		    NULL)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	expandworker(NULL);
+	for (i = 1; i < (size_t)nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if (!Nflag && xerror == 0 && fsync(dfd) == -1)
+		err(1, "%s: fsync", argv[1]);
+	if (xerror == 0)
+		printf("%s: %zu extents in %zu writes of %ju bytes\n", xname,
+		    n, nxwrites, (uintmax_t)size);
+	return (xerror);
+}
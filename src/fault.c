@@ -0,0 +1,120 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Faults injected into the writes made to a device, from a schedule
+ * given with --faults, to exercise the error paths of the writers. A
+ * fault applies to the writes that overlap its range of the device,
+ * as many times as its count, or always if the count is 0: FAULT_EIO
+ * fails the write, FAULT_SHORT writes no more than ft_arg bytes of it
+ * and FAULT_DELAY holds it for ft_arg ms first. All the faults that
+ * match a write apply to it.
+ */
+
+#include <pthread.h>
+#include <time.h>
+
+#define	FAULT_EIO	1
+#define	FAULT_SHORT	2
+#define	FAULT_DELAY	3
+
+struct fault {
+	off_t		 ft_off;	/* range of the device */
+	off_t		 ft_len;
+	int		 ft_kind;	/* FAULT_* */
+	int64_t		 ft_arg;	/* bytes written or ms of delay */
+	int		 ft_count;	/* times left to apply, -1 always */
+};
+
+int	faulting;			/* there are faults to inject */
+static struct fault *faults;
+static int nfaults;
+static pthread_mutex_t faultlock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Add a fault to the schedule.
+ */
+void
+faultadd(off_t off, off_t len, int kind, int64_t arg, int count)
+{
+	struct fault *ft;
+
+	faults = realloc(faults, (nfaults + 1) * sizeof(*faults));
+	if (faults == NULL)
+		errx(1, "realloc failed");
+	ft = &faults[nfaults++];
+	ft->ft_off = off;
+	ft->ft_len = len;
+	ft->ft_kind = kind;
+	ft->ft_arg = arg;
+	ft->ft_count = count == 0 ? -1 : count;
+	faulting = 1;
+}
+
+/*
+ * Apply the faults to a write of size bytes at off. Return the number
+ * of bytes to be written, or -1 with errno set if the write fails.
+ */
+ssize_t
+faultwrite(off_t off, size_t size)
+{
+	struct fault *ft;
+	struct timespec ts;
+	uint64_t start;
+	int64_t delay;
+	ssize_t n;
+	int i;
+
+	start = tracestart();
+	n = size;
+	delay = 0;
+	pthread_mutex_lock(&faultlock);
+	for (i = 0; i < nfaults; i++) {
+		ft = &faults[i];
+		if (ft->ft_count == 0 || off >= ft->ft_off + ft->ft_len ||
+		    off + (off_t)size <= ft->ft_off)
+			continue;
+		if (ft->ft_count > 0)
+			ft->ft_count--;
+		if (ft->ft_kind == FAULT_EIO)
+			n = -1;
+		else if (ft->ft_kind == FAULT_SHORT && n != -1)
+			n = MIN(n, ft->ft_arg);
+		else if (ft->ft_kind == FAULT_DELAY)
+			delay += ft->ft_arg;
+	}
+	pthread_mutex_unlock(&faultlock);
+	if (delay > 0) {
+		ts.tv_sec = delay / 1000;
+		ts.tv_nsec = delay % 1000 * 1000000;
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+			continue;
+	}
+	if (n != (ssize_t)size)
+		trace("fault", start, "offset", off, "size", n);
+	if (n == -1)
+		errno = EIO;
+	return (n);
+}
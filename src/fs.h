@@ -645,7 +645,7 @@ struct cg {
  * Turn filesystem block numbers into disk block addresses.
  * This maps filesystem blocks to device size blocks.
  */
-#define	fsbtodb(fs, b)	((daddr_t)(b) << (fs)->fs_fsbtodb)
+#define	fsbtodb(fs, b)	((ufs2_daddr_t)(b) << (fs)->fs_fsbtodb)
 #define	dbtofsb(fs, b)	((b) >> (fs)->fs_fsbtodb)
 
 
@@ -822,6 +822,7 @@ lbn_offset(struct fs *fs, int level)
 #define	JREC_SIZE	32	/* Record and segment header size. */
 
 #define	SUJ_MIN		(4 * 1024 * 1024)	/* Minimum journal size */
+#define	SUJ_MAX		(32 * 1024 * 1024)	/* Maximum journal size */
 #define	SUJ_FILE	".sujournal"		/* Journal file name */
 
 /*
@@ -0,0 +1,350 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * growfs.ufs: extend a UFS file system to fill a larger device.
+ *
+ * The last cylinder group is extended and new cylinder groups are
+ * added after it with initcg(), so the cost depends on the space added
+ * rather than on the size of the file system. If the summary
+ * information no longer fits where it is, it is moved to the start of
+ * the first new cylinder group. The file system must not be mounted.
+ */
+
+#define	_GNU_SOURCE
+
+#include "trace.c"
+#include "crc32.c"
+#include "fs.h"
+#include "mkfsufs.h"
+#include "arena.c"
+#include "rate.c"
+#include "fault.c"
+#include "sparse.c"
+#include "plan.c"
+#include "sblock.c"
+#include "cg.c"
+
+/*
+ * Recompute the free block and fragment counts, the fragment summary
+ * and the cluster map and summary of a cylinder group from its map of
+ * free fragments.
+ */
+static void
+cgrecount(struct cg *cgp)
+{
+	uint d, i, run;
+	int blkno;
+
+	cgp->cg_cs.cs_nbfree = 0;
+	cgp->cg_cs.cs_nffree = 0;
+	memset(cgp->cg_frsum, 0, sizeof(cgp->cg_frsum));
+	cgp->cg_nclusterblks = cgp->cg_ndblk / sblock.fs_frag;
+	for (d = 0; d < cgp->cg_ndblk; d += sblock.fs_frag) {
+		blkno = d / sblock.fs_frag;
+		if (d + sblock.fs_frag <= cgp->cg_ndblk &&
+		    isblock(&sblock, cg_blksfree(cgp), blkno)) {
+			cgp->cg_cs.cs_nbfree++;
+			if (sblock.fs_contigsumsize > 0)
+				setbit(cg_clustersfree(cgp), blkno);
+			continue;
+		}
+		if (sblock.fs_contigsumsize > 0 &&
+		    (uint)blkno < cgp->cg_nclusterblks)
+			clrbit(cg_clustersfree(cgp), blkno);
+		for (i = d, run = 0; i <= d + sblock.fs_frag; i++) {
+			if (i < d + sblock.fs_frag && i < cgp->cg_ndblk &&
+			    isset(cg_blksfree(cgp), i)) {
+				run++;
+				continue;
+			}
+			if (run != 0)
+				cgp->cg_frsum[run]++;
+			cgp->cg_cs.cs_nffree += run;
+			run = 0;
+		}
+	}
+	if (sblock.fs_contigsumsize > 0)
+		clustersum(&sblock, cgp);
+}
+
+/*
+ * Read a cylinder group, apply a change to its map and write it back
+ * with its counts recomputed.
+ */
+static void
+cgupdate(int cylno, ufs2_daddr_t from, ufs2_daddr_t to, uint ndblk)
+{
+	struct cg *cgp;
+	ufs2_daddr_t d;
+
+	if ((cgp = aligned_alloc(LIBUFS_BUFALIGN, sblock.fs_bsize)) == NULL)
+		errx(31, "aligned_alloc failed");
+	if (bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, cylno)), cgp,
+	    sblock.fs_cgsize) == -1)
+		errx(1, "cg %d: %s", cylno, d_err);
+	if (cgp->cg_magic != CG_MAGIC)
+		errx(1, "cg %d: bad magic number", cylno);
+	if (ndblk != 0)
+		cgp->cg_ndblk = ndblk;
+	for (d = from; d < to; d++)
+		setbit(cg_blksfree(cgp), d - cgbase(&sblock, cylno));
+	cgrecount(cgp);
+	fscs[cylno] = cgp->cg_cs;
+	if (!Nflag && cgwrite1(cgp) != 0)
+		errx(1, "cg %d: %s", cylno, d_err);
+	free(cgp);
+}
+
+/*
+ * Update the cylinder group count in the recovery information kept in
+ * the last sector of the boot area of a UFS2 file system.
+ */
+static void
+fsrupdate(void)
+{
+	struct fsrecovery *fsr;
+	char *buf;
+
+	if (sblock.fs_magic != FS_UFS2_MAGIC || Nflag)
+		return;
+	if ((buf = aligned_alloc(LIBUFS_BUFALIGN, DEV_BSIZE)) == NULL)
+		errx(31, "aligned_alloc failed");
+	if (pread(d_fd, buf, DEV_BSIZE, (off_t)part_ofs * sectorsize +
+	    SBLOCK_UFS2 - DEV_BSIZE) != DEV_BSIZE)
+		err(1, "can't read recovery area");
+	fsr = (struct fsrecovery *)&buf[DEV_BSIZE - sizeof(*fsr)];
+	if (fsr->fsr_magic == FS_UFS2_MAGIC) {
+		fsr->fsr_ncg = sblock.fs_ncg;
+		if (pwrite(d_fd, buf, DEV_BSIZE, (off_t)part_ofs * sectorsize +
+		    SBLOCK_UFS2 - DEV_BSIZE) != DEV_BSIZE)
+			err(1, "can't write recovery area");
+	}
+	free(buf);
+}
+
+static int
+charsperline(void)
+{
+	int columns;
+	char *cp;
+	struct winsize ws;
+
+	columns = 0;
+	if (ioctl(0, TIOCGWINSZ, &ws) != -1)
+		columns = ws.ws_col;
+	if (columns == 0 && (cp = getenv("COLUMNS")))
+		columns = atoi(cp);
+	if (columns == 0)
+		columns = 80;	/* last resort */
+	return (columns);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: growfs.ufs [-N] [-s size] special-device\n");
+	fprintf(stderr,
+	    "\t-N do not change the file system, just print out parameters\n");
+	fprintf(stderr, "\t-s new file system size (sectors)\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct csum *ocs;
+	struct stat st;
+	intmax_t size;
+	int64_t osize, nsize, lastminfpg;
+	ufs2_daddr_t ocsaddr;
+	uint32_t oncg, cylno;
+	int ch, ocsfrags, ncsfrags, devsectorsize, i, width, len;
+	char tmpbuf[100];
+	time_t utime;
+
+	size = 0;
+	while ((ch = getopt(argc, argv, "Ns:")) != -1) {
+		switch (ch) {
+		case 'N':
+			Nflag = 1;
+			break;
+		case 's':
+			if ((size = strtoimax(optarg, NULL, 0)) <= 0)
+				errx(1, "%s: bad file system size", optarg);
+			break;
+		case '?':
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+	d_name = argv[0];
+	if ((d_fd = open(d_name, Nflag ? O_RDONLY : O_RDWR)) < 0)
+		err(1, "%s", d_name);
+
+#ifndef __linux__
+#define BLKSSZGET 1
+#define BLKGETSIZE64 2
+#endif
+
+	/* Image files are as big as they are, in sectors of DEV_BSIZE. */
+	if (fstat(d_fd, &st) == -1)
+		err(1, "%s", d_name);
+	if (S_ISREG(st.st_mode)) {
+		devsectorsize = DEV_BSIZE;
+		mediasize = st.st_size;
+	} else if (ioctl(d_fd, BLKSSZGET, &devsectorsize) == -1)
+		err(1, "can't get sector size");
+	else if (ioctl(d_fd, BLKGETSIZE64, &mediasize) == -1)
+		err(1, "can't get media size");
+	realsectorsize = devsectorsize;
+	sectorsize = devsectorsize;
+	if (sbread() != 0)
+		errx(1, "%s: %s", d_name, d_err);
+	if (sblock.fs_clean == 0 || (sblock.fs_flags & FS_NEEDSFSCK) != 0)
+		errx(1, "%s: file system is not clean, run fsck first", d_name);
+	Oflag = sblock.fs_magic == FS_UFS1_MAGIC ? 1 : 2;
+	d_ufs = Oflag;
+
+	/*
+	 * The new size is in sectors of the device, as for mkfs.ufs.
+	 */
+	if (size == 0)
+		size = mediasize / devsectorsize;
+	else if (size * devsectorsize > mediasize)
+		errx(1, "%s: size %jd is larger than the device", d_name, size);
+	osize = sblock.fs_size;
+	nsize = (size * devsectorsize) / sblock.fs_fsize;
+	oncg = sblock.fs_ncg;
+
+	/*
+	 * Leave out a last cylinder group that would be too small to
+	 * hold its own metadata, as newfs does.
+	 */
+	lastminfpg = roundup(sblock.fs_iblkno + sblock.fs_ipg / INOPF(&sblock),
+	    sblock.fs_frag);
+	if (nsize % sblock.fs_fpg != 0 && nsize % sblock.fs_fpg < lastminfpg &&
+	    nsize / sblock.fs_fpg >= oncg)
+		nsize -= nsize % sblock.fs_fpg;
+	if (nsize <= osize)
+		errx(1, "%s: new size %jd is not larger than current size %jd",
+		    d_name, (intmax_t)nsize, (intmax_t)osize);
+	sblock.fs_size = nsize;
+	sblock.fs_ncg = howmany(nsize, sblock.fs_fpg);
+
+	/*
+	 * The summary information grows with the number of cylinder
+	 * groups. It stays where it is if the fragments it has will
+	 * hold it, and moves to the first new cylinder group otherwise.
+	 */
+	ocs = fscs;
+	ocsaddr = sblock.fs_csaddr;
+	ocsfrags = howmany(sblock.fs_cssize, sblock.fs_fsize);
+	sblock.fs_cssize =
+	    fragroundup(&sblock, sblock.fs_ncg * sizeof(struct csum));
+	ncsfrags = howmany(sblock.fs_cssize, sblock.fs_fsize);
+	if (ncsfrags > ocsfrags) {
+		sblock.fs_csaddr = cgdmin(&sblock, oncg);
+		if (sblock.fs_csaddr + ncsfrags > MIN(sblock.fs_size,
+		    cgbase(&sblock, oncg + 1)))
+			errx(1, "%s: no room for the summary information in "
+			    "the new cylinder groups", d_name);
+	}
+	if ((fscs = calloc(1, sblock.fs_cssize)) == NULL)
+		errx(31, "calloc failed");
+	memcpy(fscs, ocs, oncg * sizeof(struct csum));
+	free(ocs);
+	sblock.fs_dsize = sblock.fs_size - sblock.fs_sblkno -
+	    sblock.fs_ncg * (sblock.fs_dblkno - sblock.fs_sblkno) - ncsfrags;
+	sblock.fs_providersize = dbtofsb(&sblock, mediasize / sectorsize);
+	if (Oflag == 1) {
+		sblock.fs_old_size = sblock.fs_size;
+		sblock.fs_old_dsize = sblock.fs_dsize;
+		sblock.fs_old_ncyl = sblock.fs_ncg;
+		sblock.fs_old_csaddr = sblock.fs_csaddr;
+	}
+
+	printf("new file system size is: %jd frags (%jdMB)\n",
+	    (intmax_t)sblock.fs_size,
+	    (intmax_t)lfragtosize(&sblock, sblock.fs_size) / (1024 * 1024));
+	printf("Using %d cylinder groups of %.2fMB, %d blks, %d inodes.\n",
+	    sblock.fs_ncg, (float)sblock.fs_fpg * sblock.fs_fsize /
+	    (1024 * 1024), sblock.fs_fpg / sblock.fs_frag, sblock.fs_ipg);
+	if (sblock.fs_csaddr != ocsaddr)
+		printf("summary information moved to %jd\n",
+		    (intmax_t)sblock.fs_csaddr);
+
+	/*
+	 * Build the new cylinder groups, then extend the old last one
+	 * and free the old summary information if it was moved.
+	 */
+	utime = time(NULL);
+	iobufsize = MAX(2 * sblock.fs_bsize, MAXPHYS);
+	if (!Nflag && sblock.fs_ncg > oncg)
+		initcgs(oncg, sblock.fs_ncg, utime);
+	cylno = oncg - 1;
+	cgupdate(cylno, osize, MIN(sblock.fs_size, cgbase(&sblock, oncg)),
+	    MIN(sblock.fs_size, cgbase(&sblock, oncg)) -
+	    cgbase(&sblock, cylno));
+	if (sblock.fs_csaddr != ocsaddr)
+		cgupdate(dtog(&sblock, ocsaddr), ocsaddr, ocsaddr + ocsfrags, 0);
+
+	/*
+	 * With every cylinder group in place, write the summary
+	 * information and all of the superblocks.
+	 */
+	cssum(fscs, sblock.fs_ncg, &sblock.fs_cstotal);
+	if ((sblock.fs_si = calloc(1, sizeof(*sblock.fs_si))) == NULL)
+		errx(31, "calloc failed");
+	sblock.fs_csp = fscs;
+	sblock.fs_sblockactualloc = sblock.fs_sblockloc;
+	if (!Nflag && sbwrite(1) != 0)
+		err(1, "sbwrite: %s", d_err);
+	fsrupdate();
+
+	if (sblock.fs_ncg > oncg) {
+		printf("super-block backups (for fsck_ffs -b #) at:\n");
+		width = charsperline();
+		for (i = 0, cylno = oncg; cylno < sblock.fs_ncg; cylno++) {
+			len = snprintf(tmpbuf, sizeof(tmpbuf), " %jd%s",
+			    (intmax_t)fsbtodb(&sblock, cgsblock(&sblock, cylno)),
+			    cylno < sblock.fs_ncg - 1 ? "," : "");
+			if (i + len >= width) {
+				printf("\n");
+				i = 0;
+			}
+			i += len;
+			printf("%s", tmpbuf);
+		}
+		printf("\n");
+	}
+	close(d_fd);
+	return (0);
+}
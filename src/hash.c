@@ -0,0 +1,163 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Write a manifest of content hashes of a newly made file system, so
+ * that identical images can be recognized without comparing them. The
+ * file system is read back in regions, one for each cylinder group,
+ * and each region gets a CRC32C and a SHA-256. The line for the whole
+ * file system has the CRC32C and SHA-256 of the list of region hashes
+ * rather than of the data, so that regions can be hashed at once by
+ * several threads. All offsets are in bytes from the start of the file
+ * system.
+ */
+
+#include <endian.h>
+
+#define	MAXHASHTHREADS	16
+
+struct rhash {
+	off_t		 rh_off;	/* start of region */
+	off_t		 rh_len;	/* length of region */
+	uint32_t	 rh_crc;	/* CRC32C of its contents */
+	uint8_t		 rh_sha[SHA256_DIGEST_LENGTH];
+};
+
+static struct rhash *rhashes;
+static int rhnext;		/* next region to be hashed */
+static int rherror;		/* errno of the first failed read */
+
+static void *
+hashworker(void *arg)
+{
+	struct rhash *rh;
+	SHA256_CTX ctx;
+	char *buf;
+	off_t off;
+	ssize_t n;
+	int cg;
+
+	if ((buf = aligned_alloc(LIBUFS_BUFALIGN, MAXPHYS)) == NULL)
+		errx(31, "aligned_alloc failed");
+	while (__atomic_load_n(&rherror, __ATOMIC_RELAXED) == 0 &&
+	    (cg = __atomic_fetch_add(&rhnext, 1, __ATOMIC_RELAXED)) <
+	    (int)sblock.fs_ncg) {
+		rh = &rhashes[cg];
+		rh->rh_crc = ~0U;
+		SHA256_Init(&ctx);
+		for (off = 0; off < rh->rh_len; off += n) {
+			n = dpread(d_fd, buf, MIN(MAXPHYS, rh->rh_len - off),
+			    part_ofs * sectorsize + rh->rh_off + off);
+			if (n <= 0) {
+				__atomic_compare_exchange_n(&rherror,
+				    &(int){ 0 }, n == 0 ? EIO : errno, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+				break;
+			}
+			rh->rh_crc = calculate_crc32c(rh->rh_crc,
+			    (unsigned char *)buf, n);
+			SHA256_Update(&ctx, buf, n);
+		}
+		rh->rh_crc ^= ~0U;
+		SHA256_Final(rh->rh_sha, &ctx);
+	}
+	free(buf);
+	return (arg);
+}
+
+static void
+hashprint(FILE *fp, const char *name, off_t off, off_t len, uint32_t crc,
+    const uint8_t *sha)
+{
+	int i;
+
+	fprintf(fp, "%s %jd %jd %08x ", name, (intmax_t)off, (intmax_t)len,
+	    crc);
+	for (i = 0; i < SHA256_DIGEST_LENGTH; i++)
+		fprintf(fp, "%02x", sha[i]);
+	fprintf(fp, "\n");
+}
+
+void
+fshash(const char *file)
+{
+	pthread_t threads[MAXHASHTHREADS];
+	uint8_t sha[SHA256_DIGEST_LENGTH];
+	char name[32];
+	SHA256_CTX ctx;
+	FILE *fp;
+	uint32_t crc, le;
+	long nthreads;
+	int cg, i, error;
+
+	if (strcmp(file, "-") == 0)
+		fp = stdout;
+	else if ((fp = fopen(file, "w")) == NULL)
+		err(1, "%s", file);
+	if ((rhashes = calloc(sblock.fs_ncg, sizeof(*rhashes))) == NULL)
+		errx(31, "calloc failed");
+	for (cg = 0; cg < (int)sblock.fs_ncg; cg++) {
+		rhashes[cg].rh_off = (off_t)cgbase(&sblock, cg) *
+		    sblock.fs_fsize;
+		rhashes[cg].rh_len = (off_t)(MIN(cgbase(&sblock, cg + 1),
+		    sblock.fs_size) - cgbase(&sblock, cg)) * sblock.fs_fsize;
+	}
+	rhnext = 0;
+	rherror = 0;
+	nthreads = ncpus();
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXHASHTHREADS,
+	    (long)sblock.fs_ncg)));
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, hashworker,
+		    NULL)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	hashworker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	if (rherror != 0) {
+		errno = rherror;
+		err(47, "%s: can't read file system", d_name);
+	}
+
+	fprintf(fp, "# region offset length crc32c sha256\n");
+	crc = ~0U;
+	SHA256_Init(&ctx);
+	for (cg = 0; cg < (int)sblock.fs_ncg; cg++) {
+		snprintf(name, sizeof(name), "cg%d", cg);
+		hashprint(fp, name, rhashes[cg].rh_off, rhashes[cg].rh_len,
+		    rhashes[cg].rh_crc, rhashes[cg].rh_sha);
+		le = htole32(rhashes[cg].rh_crc);
+		crc = calculate_crc32c(crc, (unsigned char *)&le, sizeof(le));
+		SHA256_Update(&ctx, rhashes[cg].rh_sha, SHA256_DIGEST_LENGTH);
+	}
+	SHA256_Final(sha, &ctx);
+	hashprint(fp, "fs", 0, (off_t)sblock.fs_size * sblock.fs_fsize,
+	    crc ^ ~0U, sha);
+	free(rhashes);
+	rhashes = NULL;
+	if (fp != stdout && fclose(fp) != 0)
+		err(1, "%s", file);
+}
@@ -38,20 +38,37 @@
  * SUCH DAMAGE.
  */
 
+/* O_DIRECT */
+#define	_GNU_SOURCE
+
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+
+#include "trace.c"
 #include "crc32.c"
 #include "fs.h"
 #include "mkfsufs.h"
+#include "arena.c"
+#include "rate.c"
+#include "fault.c"
+#include "sparse.c"
+#include "plan.c"
 #include "sblock.c"
 #include "cg.c"
+#include "tree.c"
+#include "part.c"
 #include "root.c"
 #include "newfs.c"
+#include "verify.c"
+#include "sha256.c"
+#include "hash.c"
 
 
 
 void usage(char *name)
 {
 	fprintf(stderr,
-	    "usage: %s [ -fsoptions ] special-device%s\n",
+	    "usage: %s [ -fsoptions ] special-device ...%s\n",
 	    name,
 	    " [device-type]");
 	fprintf(stderr, "where fsoptions are:\n");
@@ -81,21 +98,643 @@ void usage(char *name)
 	fprintf(stderr, "\t-r reserved sectors at the end of device\n");
 	fprintf(stderr, "\t-s file system size (sectors)\n");
 	fprintf(stderr, "\t-t enable TRIM\n");
+	fprintf(stderr, "\t--mkdir path create a directory\n");
+	fprintf(stderr,
+	    "\t--prealloc path:size preallocate a contiguous file\n");
+	fprintf(stderr,
+	    "\t--shard path:fanout[:levels] create hashed subdirectories\n");
+	fprintf(stderr, "\t--verify read back and check the file system\n");
+	fprintf(stderr,
+	    "\t--resume continue an interrupted format of the same file system\n");
+	fprintf(stderr, "\t--jobs n format up to n devices at once\n");
+	fprintf(stderr, "\t--manifest file format the devices listed in file\n");
+	fprintf(stderr, "\t--offset size make the file system at this offset\n");
+	fprintf(stderr,
+	    "\t--partition n|ufs make the file system in a GPT or MBR partition\n");
+	fprintf(stderr, "\t--mmap write an image file through a mapping\n");
+	fprintf(stderr, "\t--plan file list the writes made, in the order made\n");
+	fprintf(stderr,
+	    "\t--hashes file write CRC32C and SHA-256 hashes of the image\n");
+	fprintf(stderr,
+	    "\t--sparse size make a sparse image of a device of this size,\n"
+	    "\t    or a stream of its writes if the device is -\n");
+	fprintf(stderr,
+	    "\t--trace file write a Chrome trace of the format to file\n");
+	fprintf(stderr,
+	    "\t--prefill none|n|full inode blocks to initialize per group\n");
+	fprintf(stderr,
+	    "\t--numa node|off NUMA node to run on, by default the device's\n");
+	fprintf(stderr, "\t--max-iops n writes per second to a device\n");
+	fprintf(stderr, "\t--max-rate size bytes per second to a device\n");
+	fprintf(stderr,
+	    "\t--max-latency ms slow down when writes take longer than this\n");
+	fprintf(stderr, "\t--idle write in the idle I/O scheduling class\n");
+	fprintf(stderr, "\t--faults file inject the faults in file into writes\n");
 	exit(1);
 }
 
-int main(int argc, char *argv[])
+/*
+ * Options that have no single letter equivalent.
+ */
+#define	OPT_PREALLOC	256
+#define	OPT_MKDIR	257
+#define	OPT_SHARD	258
+#define	OPT_VERIFY	259
+#define	OPT_RESUME	260
+#define	OPT_JOBS	261
+#define	OPT_MANIFEST	262
+#define	OPT_OFFSET	263
+#define	OPT_PARTITION	264
+#define	OPT_MMAP	265
+#define	OPT_PLAN	266
+#define	OPT_HASHES	267
+#define	OPT_SPARSE	268
+#define	OPT_TRACE	269
+#define	OPT_PREFILL	270
+#define	OPT_NUMA	271
+#define	OPT_MAXIOPS	272
+#define	OPT_MAXRATE	273
+#define	OPT_MAXLATENCY	274
+#define	OPT_IDLE	275
+#define	OPT_FAULTS	276
+
+static struct option longopts[] = {
+	{ "mkdir",	required_argument,	NULL,	OPT_MKDIR },
+	{ "prealloc",	required_argument,	NULL,	OPT_PREALLOC },
+	{ "shard",	required_argument,	NULL,	OPT_SHARD },
+	{ "verify",	no_argument,		NULL,	OPT_VERIFY },
+	{ "resume",	no_argument,		NULL,	OPT_RESUME },
+	{ "jobs",	required_argument,	NULL,	OPT_JOBS },
+	{ "manifest",	required_argument,	NULL,	OPT_MANIFEST },
+	{ "offset",	required_argument,	NULL,	OPT_OFFSET },
+	{ "partition",	required_argument,	NULL,	OPT_PARTITION },
+	{ "mmap",	no_argument,		NULL,	OPT_MMAP },
+	{ "plan",	required_argument,	NULL,	OPT_PLAN },
+	{ "hashes",	required_argument,	NULL,	OPT_HASHES },
+	{ "sparse",	required_argument,	NULL,	OPT_SPARSE },
+	{ "trace",	required_argument,	NULL,	OPT_TRACE },
+	{ "prefill",	required_argument,	NULL,	OPT_PREFILL },
+	{ "numa",	required_argument,	NULL,	OPT_NUMA },
+	{ "max-iops",	required_argument,	NULL,	OPT_MAXIOPS },
+	{ "max-rate",	required_argument,	NULL,	OPT_MAXRATE },
+	{ "max-latency", required_argument,	NULL,	OPT_MAXLATENCY },
+	{ "idle",	no_argument,		NULL,	OPT_IDLE },
+	{ "faults",	required_argument,	NULL,	OPT_FAULTS },
+	{ NULL,		0,			NULL,	0 }
+};
+
+/*
+ * Parse a size in bytes, which may have a k, m, g or t suffix.
+ * Return -1 if it is not valid.
+ */
+static intmax_t
+parsesize(const char *arg)
+{
+	static const char suffixes[] = "kmgt";
+	intmax_t size;
+	char *ep;
+
+	errno = 0;
+	size = strtoimax(arg, &ep, 10);
+	if (*ep != '\0' && (ep[1] == '\0' || ep[1] == 'b' || ep[1] == 'B') &&
+	    strchr(suffixes, tolower(*ep)) != NULL) {
+		size <<= 10 * (strchr(suffixes, tolower(*ep)) - suffixes + 1);
+		ep += ep[1] == '\0' ? 1 : 2;
+	}
+	if (errno != 0 || *ep != '\0' || ep == arg || size < 0)
+		return (-1);
+	return (size);
+}
+
+/*
+ * Parse the "path:size" argument of --prealloc. Missing directories
+ * in the path are created.
+ */
+static void
+addprealloc(char *arg)
+{
+	struct prealloc *pa;
+	struct fsnode *np;
+	char *name, *cp;
+	intmax_t size;
+
+	if ((cp = strrchr(arg, ':')) == NULL)
+		errx(1, "%s: preallocated file must be given as path:size",
+		    arg);
+	*cp++ = '\0';
+	for (name = arg; *name == '/'; name++)
+		continue;
+	if ((size = parsesize(cp)) <= 0)
+		errx(1, "%s: bad preallocated file size", cp);
+	if ((np = fsmkpath(name, DT_REG)) == NULL)
+		errx(1, "%s: bad or duplicate preallocated file name", arg);
+	preallocs = realloc(preallocs, (npreallocs + 1) * sizeof(*preallocs));
+	if (preallocs == NULL || (pa = calloc(1, sizeof(*pa))) == NULL)
+		errx(1, "realloc failed");
+	preallocs[npreallocs++] = pa;
+	pa->pa_name = name;
+	pa->pa_size = size;
+	pa->pa_mode = PREALLOCMODE;
+	pa->pa_flags = 0;
+	pa->pa_clear = 0;
+	np->fn_pa = pa;
+}
+
+/*
+ * Parse the "path:fanout[:levels]" argument of --shard, which creates
+ * "levels" levels of "fanout" directories each below the path, as used
+ * by caches and object stores that hash names into a fixed tree.
+ */
+#define	MAXSHARDS	(1 << 24)
+
+static void
+addshard(char *arg)
+{
+	struct fsnode *np;
+	char *cp, *ep;
+	long fanout, levels, total;
+	int i;
+
+	levels = 1;
+	if ((cp = strchr(arg, ':')) == NULL)
+		errx(1, "%s: shards must be given as path:fanout[:levels]", arg);
+	*cp++ = '\0';
+	fanout = strtol(cp, &ep, 10);
+	if (*ep == ':')
+		levels = strtol(ep + 1, &ep, 10);
+	if (*ep != '\0' || fanout < 1 || fanout > 65536 || levels < 1)
+		errx(1, "%s: bad shard fanout or levels", cp);
+	for (total = 0, i = 0; i < levels; i++) {
+		total = total * fanout + fanout;
+		if (total > MAXSHARDS)
+			errx(1, "%s: too many shard directories", arg);
+	}
+	if ((np = fsmkpath(arg, DT_DIR)) == NULL)
+		errx(1, "%s: bad shard directory", arg);
+	fsshard(np, fanout, levels);
+}
+
+/*
+ * Add the devices listed in a manifest, one per line, to the targets.
+ * Blank lines and anything after a '#' are ignored.
+ */
+static void
+addmanifest(const char *path, char ***targetsp, int *ntargetsp)
+{
+	FILE *fp;
+	char *line, *cp, *ep;
+	size_t linesize;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	line = NULL;
+	linesize = 0;
+	while (getline(&line, &linesize, fp) != -1) {
+		if ((cp = strchr(line, '#')) != NULL)
+			*cp = '\0';
+		for (cp = line; isspace((unsigned char)*cp); cp++)
+			continue;
+		for (ep = cp + strlen(cp); ep > cp &&
+		    isspace((unsigned char)ep[-1]); ep--)
+			continue;
+		if (ep == cp)
+			continue;
+		*ep = '\0';
+		*targetsp = realloc(*targetsp, (*ntargetsp + 1) *
+		    sizeof(**targetsp));
+		if (*targetsp == NULL || ((*targetsp)[(*ntargetsp)++] =
+		    strdup(cp)) == NULL)
+			errx(1, "realloc failed");
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Add the faults to be injected into writes, one per line as
+ *
+ *	offset[:length] eio|short=bytes|delay=ms [count]
+ *
+ * where the offsets are of the device and a length of 0 or none
+ * stands for 1. A fault applies count times, 1 by default, or always
+ * if count is 0. Blank lines and anything after a '#' are ignored.
+ */
+static void
+addfaults(const char *path)
+{
+	static const char *kinds[] = { NULL, "eio", "short", "delay" };
+	FILE *fp;
+	char *line, *cp, *range, *fault, *count, *arg;
+	intmax_t off, len, val;
+	size_t linesize;
+	int kind, lineno;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+	line = NULL;
+	linesize = 0;
+	lineno = 0;
+	while (getline(&line, &linesize, fp) != -1) {
+		lineno++;
+		if ((cp = strchr(line, '#')) != NULL)
+			*cp = '\0';
+		cp = line;
+		range = fault = count = NULL;
+		while ((arg = strsep(&cp, " \t\n")) != NULL) {
+			if (*arg == '\0')
+				continue;
+			if (range == NULL)
+				range = arg;
+			else if (fault == NULL)
+				fault = arg;
+			else if (count == NULL)
+				count = arg;
+			else
+				errx(1, "%s:%d: too many fields", path, lineno);
+		}
+		if (range == NULL)
+			continue;
+		if (fault == NULL)
+			errx(1, "%s:%d: no fault", path, lineno);
+		len = 1;
+		if ((cp = strchr(range, ':')) != NULL) {
+			*cp++ = '\0';
+			if ((len = parsesize(cp)) < 0)
+				errx(1, "%s:%d: %s: bad length", path, lineno,
+				    cp);
+			len = MAX(len, 1);
+		}
+		if ((off = parsesize(range)) < 0)
+			errx(1, "%s:%d: %s: bad offset", path, lineno, range);
+		if ((arg = strchr(fault, '=')) != NULL)
+			*arg++ = '\0';
+		for (kind = FAULT_EIO; kind <= FAULT_DELAY; kind++)
+			if (strcmp(fault, kinds[kind]) == 0)
+				break;
+		if (kind > FAULT_DELAY)
+			errx(1, "%s:%d: %s: unknown fault", path, lineno, fault);
+		val = 0;
+		if ((kind == FAULT_EIO) != (arg == NULL) ||
+		    (arg != NULL && (val = parsesize(arg)) < 0))
+			errx(1, "%s:%d: %s: bad argument", path, lineno,
+			    arg != NULL ? arg : fault);
+		if (count != NULL && strspn(count, "0123456789") !=
+		    strlen(count))
+			errx(1, "%s:%d: %s: bad count", path, lineno, count);
+		faultadd(off, len, kind, val, count != NULL ? atoi(count) : 1);
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Query the physical sector size and the minimum and optimal I/O sizes
+ * of the device, which for md and hardware RAID are the chunk and the
+ * stripe width. Block devices that do not answer the ioctls are looked
+ * up in sysfs, where a partition has its queue in the parent's entry.
+ */
+#ifndef BLKIOMIN
+#define	BLKIOMIN	_IO(0x12, 120)
+#define	BLKIOOPT	_IO(0x12, 121)
+#define	BLKPBSZGET	_IO(0x12, 123)
+#endif
+
+static int
+sysfsqueue(struct stat *st, const char *attr)
+{
+	static const char *dirs[] = { "queue", "../queue" };
+	char path[MAXPATHLEN];
+	FILE *fp;
+	size_t i;
+	int val;
+
+	if (!S_ISBLK(st->st_mode))
+		return (0);
+	for (i = 0; i < sizeof(dirs) / sizeof(dirs[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s/%s",
+		    major(st->st_rdev), minor(st->st_rdev), dirs[i], attr);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		if (fscanf(fp, "%d", &val) != 1)
+			val = 0;
+		fclose(fp);
+		return (MAX(val, 0));
+	}
+	return (0);
+}
+
+/*
+ * The NUMA node of the controller a device hangs off, or -1.
+ */
+static int
+sysfsnode(struct stat *st)
+{
+	static const char *attrs[] = { "device/numa_node",
+	    "device/device/numa_node", "../device/numa_node",
+	    "../device/device/numa_node" };
+	char path[MAXPATHLEN];
+	FILE *fp;
+	size_t i;
+	int val;
+
+	if (!S_ISBLK(st->st_mode))
+		return (-1);
+	for (i = 0; i < sizeof(attrs) / sizeof(attrs[0]); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/block/%u:%u/%s",
+		    major(st->st_rdev), minor(st->st_rdev), attrs[i]);
+		if ((fp = fopen(path, "r")) == NULL)
+			continue;
+		if (fscanf(fp, "%d", &val) != 1)
+			val = -1;
+		fclose(fp);
+		return (MAX(val, -1));
+	}
+	return (-1);
+}
+
+/*
+ * Run on the processors of NUMA node numanode, if there is more than
+ * one node. The threads started from here on inherit the binding, so
+ * the buffers they first touch and the arenas, which prefer the node,
+ * are local to the controller of the device.
+ */
+static void
+numabind(void)
+{
+	char path[MAXPATHLEN], list[4096], *cp, *range;
+	cpu_set_t set, allowed;
+	FILE *fp;
+	int lo, hi, cpu;
+
+	if (numanode < 0)
+		return;
+	if ((fp = fopen("/sys/devices/system/node/online", "r")) == NULL)
+		return;
+	if (fgets(list, sizeof(list), fp) == NULL ||
+	    strcspn(list, ",-") == strlen(list)) {
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	snprintf(path, sizeof(path),
+	    "/sys/devices/system/node/node%d/cpulist", numanode);
+	if ((fp = fopen(path, "r")) == NULL) {
+		warn("%s", path);
+		return;
+	}
+	if (fgets(list, sizeof(list), fp) == NULL)
+		list[0] = '\0';
+	fclose(fp);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+		return;
+	CPU_ZERO(&set);
+	for (cp = list; (range = strsep(&cp, ",\n")) != NULL; ) {
+		if (*range == '\0')
+			continue;
+		if (sscanf(range, "%d-%d", &lo, &hi) != 2)
+			hi = lo = atoi(range);
+		for (cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &allowed))
+				CPU_SET(cpu, &set);
+	}
+	if (CPU_COUNT(&set) == 0) {
+		warnx("NUMA node %d: no processors to run on", numanode);
+		return;
+	}
+	if (sched_setaffinity(0, sizeof(set), &set) == -1)
+		warn("sched_setaffinity");
+}
+
+static void
+getiotopo(void)
+{
+	struct stat st;
+	unsigned int val;
+
+	if (fstat(d_fd, &st) == -1)
+		return;
+	if (ioctl(d_fd, BLKPBSZGET, &val) == 0)
+		physsectorsize = val;
+	else
+		physsectorsize = sysfsqueue(&st, "physical_block_size");
+	if (ioctl(d_fd, BLKIOMIN, &val) == 0)
+		iomin = val;
+	else
+		iomin = sysfsqueue(&st, "minimum_io_size");
+	if (ioctl(d_fd, BLKIOOPT, &val) == 0)
+		ioopt = val;
+	else
+		ioopt = sysfsqueue(&st, "optimal_io_size");
+	rotational = sysfsqueue(&st, "rotational");
+	if (numanode == -2)
+		numanode = sysfsnode(&st);
+	/*
+	 * Single disks report their physical sector as the minimum and
+	 * nothing or something unhelpful as the optimum.
+	 */
+	if (iomin <= physsectorsize || ioopt <= iomin || ioopt % iomin != 0)
+		ioopt = 0;
+}
+
+/*
+ * Format one device with the options already parsed.
+ */
+static void
+mkfsone(char *special, intmax_t reserved)
 {
 	static char	device[MAXPATHLEN];
-	char *cp, *special;
+	struct stat st;
+	FILE *tmp;
+	char *cp;
+	int streamfd;
+
+	if (!special[0])
+		err(1, "empty file/special name");
+	cp = strrchr(special, '/');
+	if (cp == NULL && (sparsesize == 0 || strcmp(special, "-") != 0)) {
+		/*
+		 * No path prefix; try prefixing _PATH_DEV.
+		 */
+		snprintf(device, sizeof(device), "%s%s", _PATH_DEV, special);
+		special = device;
+	}
+
+
+	d_name = special;
+
+	/*
+	 * A sparse image is made from scratch, of the size given and with
+	 * the sector size given or DEV_BSIZE. One for standard output is
+	 * made in a temporary file and sent as a stream once it is done;
+	 * everything else that would be printed goes to standard error.
+	 */
+	streamfd = -1;
+	if (sparsesize > 0) {
+		if (mmapflag || partindex >= 0)
+			errx(1, "--sparse is not usable with --mmap or --partition");
+		if (sectorsize == 0)
+			sectorsize = DEV_BSIZE;
+		mediasize = sparsesize;
+		if (Nflag)
+			d_fd = -1;
+		else if (strcmp(special, "-") != 0)
+			d_fd = open(special, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		else if ((tmp = tmpfile()) == NULL)
+			err(1, "tmpfile");
+		else if ((d_fd = dup(fileno(tmp))) < 0 ||
+		    (streamfd = dup(STDOUT_FILENO)) < 0 ||
+		    dup2(STDERR_FILENO, STDOUT_FILENO) < 0)
+			err(1, "dup");
+		if (d_fd < 0 && !Nflag)
+			err(1, "%s", special);
+		if (!Nflag)
+			sparseopen(d_fd, sparsesize);
+	} else
+		d_fd = open(special, O_RDWR);
+	if (d_fd < 0 && !Nflag)
+		errx(1, "failed to open disk for writing %s: ", special);
+
+	#ifndef __linux__
+		#define BLKSSZGET 1
+		#define BLKGETSIZE64 2
+	#endif
+
+	/*
+	 * Image files have no sector size or media size to ask for; they
+	 * are as big as they are, in sectors of DEV_BSIZE unless -S says
+	 * otherwise.
+	 */
+	if (sparsesize == 0 && d_fd >= 0 && fstat(d_fd, &st) == 0 &&
+	    S_ISREG(st.st_mode)) {
+		if (sectorsize == 0)
+			sectorsize = DEV_BSIZE;
+		if (mediasize == 0)
+			mediasize = st.st_size;
+	}
+
+	if (sectorsize == 0)
+		if (ioctl(d_fd, BLKSSZGET, &sectorsize) == -1)
+		    	err(1, "can't get sector size");	
+	   
+	if (mediasize == 0)
+		if(ioctl(d_fd, BLKGETSIZE64, &mediasize) == -1)
+			err(1, "can't get media size");
+
+	getiotopo();
+	numabind();
+	if (partindex >= 0 || partoffset > 0)
+		usepart();
+	if (mmapflag && !Nflag)
+		mapimage();
+
+	fssize = mediasize / sectorsize - reserved;
+	if (fsize <= 0)
+		fsize = MAX(DFL_FRAGSIZE, MAX(sectorsize, physsectorsize));
+	if (bsize <= 0)
+		bsize = MIN(DFL_BLKSIZE, 8 * fsize);
+	
+	/* Use soft updates by default for UFS2 and above */
+	if (Oflag > 1)
+		Uflag = 1;
+	realsectorsize = sectorsize;
+
+	mkfs(d_name);
+	unmapimage();
+	if (verify && fsverify() != 0)
+		errx(48, "%s: verification failed", d_name);
+	if (hashfile != NULL)
+		fshash(hashfile);
+	if (streamfd >= 0) {
+		if (sparsestream(streamfd) != 0)
+			err(1, "can't write stream");
+		close(streamfd);
+	} else if (sparseclose() != 0)
+		err(1, "%s: can't write sparse image", d_name);
+	close(d_fd);
+}
+
+/*
+ * Format several devices, each in a process of its own as the state of
+ * a format is global, with at most "jobs" of them running at once. The
+ * output of each is kept aside and printed in one piece when it is done.
+ * Return the exit status of the first one to fail, if any.
+ */
+static int
+mkfsbatch(char **targets, int ntargets, int jobs, intmax_t reserved)
+{
+	struct batchjob {
+		pid_t	 bj_pid;	/* process formatting the device */
+		FILE	*bj_out;	/* its standard output */
+	} *bj;
+	char buf[BUFSIZ];
+	pid_t pid;
+	size_t n;
+	int i, next, running, status, wstatus;
+
+	if ((bj = calloc(ntargets, sizeof(*bj))) == NULL)
+		errx(1, "calloc failed");
+	next = running = status = 0;
+	while (next < ntargets || running > 0) {
+		if (next < ntargets && running < jobs) {
+			if ((bj[next].bj_out = tmpfile()) == NULL)
+				err(1, "tmpfile");
+			fflush(NULL);
+			if ((pid = fork()) == -1)
+				err(1, "fork");
+			if (pid == 0) {
+				if (dup2(fileno(bj[next].bj_out),
+				    STDOUT_FILENO) == -1)
+					err(1, "dup2");
+				mkfsone(targets[next], reserved);
+				exit(0);
+			}
+			bj[next++].bj_pid = pid;
+			running++;
+			continue;
+		}
+		if ((pid = wait(&wstatus)) == -1)
+			err(1, "wait");
+		for (i = 0; i < next && bj[i].bj_pid != pid; i++)
+			continue;
+		if (i == next)
+			continue;
+		running--;
+		printf("%s:\n", targets[i]);
+		rewind(bj[i].bj_out);
+		while ((n = fread(buf, 1, sizeof(buf), bj[i].bj_out)) > 0)
+			fwrite(buf, 1, n, stdout);
+		fclose(bj[i].bj_out);
+		fflush(stdout);
+		if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+			warnx("%s: format failed", targets[i]);
+			if (status == 0)
+				status = WIFEXITED(wstatus) ?
+				    WEXITSTATUS(wstatus) : 1;
+		}
+	}
+	free(bj);
+	return (status);
+}
+
+int main(int argc, char *argv[])
+{
+	char **targets, *manifest, *cp, *ep;
 	intmax_t reserved;
-	int ch;
+	int ch, jobs, ntargets;
 	size_t i;
 	char *prog_name = argv[0];
 
-
-    while ((ch = getopt(argc, argv,
-	    "EJL:NO:RS:T:UXa:b:c:d:e:f:g:h:i:jk:lm:no:p:r:s:t")) != -1) {
+	targets = NULL;
+	manifest = NULL;
+	jobs = ntargets = 0;
+	reserved = 0;
+    while ((ch = getopt_long(argc, argv,
+	    "EJL:NO:RS:T:UXa:b:c:d:e:f:g:h:i:jk:lm:no:p:r:s:t", longopts,
+	    NULL)) != -1) {
 	switch (ch) {
 		case 'E':
 			Eflag = 1;
@@ -218,6 +857,90 @@ int main(int argc, char *argv[])
 		case 't':
 			tflag = 1;
 			break;
+		case OPT_MKDIR:
+			if (fsmkpath(optarg, DT_DIR) == NULL)
+				errx(1, "%s: bad directory name", optarg);
+			break;
+		case OPT_PREALLOC:
+			addprealloc(optarg);
+			break;
+		case OPT_SHARD:
+			addshard(optarg);
+			break;
+		case OPT_VERIFY:
+			verify = 1;
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_JOBS:
+			if ((jobs = atoi(optarg)) <= 0)
+				errx(1, "%s: bad number of jobs", optarg);
+			break;
+		case OPT_OFFSET:
+			if ((partoffset = parsesize(optarg)) < 0)
+				errx(1, "%s: bad offset", optarg);
+			break;
+		case OPT_PARTITION:
+			if (strcmp(optarg, "ufs") == 0)
+				partindex = 0;
+			else if ((partindex = atoi(optarg)) <= 0)
+				errx(1, "%s: bad partition", optarg);
+			break;
+		case OPT_MMAP:
+			mmapflag = 1;
+			break;
+		case OPT_PLAN:
+			planfile = optarg;
+			break;
+		case OPT_HASHES:
+			hashfile = optarg;
+			break;
+		case OPT_SPARSE:
+			if ((sparsesize = parsesize(optarg)) <= 0)
+				errx(1, "%s: bad size", optarg);
+			break;
+		case OPT_TRACE:
+			tracefile = optarg;
+			break;
+		case OPT_PREFILL:
+			if (strcmp(optarg, "none") == 0)
+				prefill = 0;
+			else if (strcmp(optarg, "full") == 0)
+				prefill = -1;
+			else if ((prefill = atoi(optarg)) <= 0)
+				errx(1, "%s: bad number of inode blocks", optarg);
+			break;
+		case OPT_NUMA:
+			if (strcmp(optarg, "off") == 0)
+				numanode = -1;
+			else if ((numanode = atoi(optarg)) < 0 ||
+			    !isdigit((unsigned char)*optarg))
+				errx(1, "%s: bad NUMA node", optarg);
+			break;
+		case OPT_MAXIOPS:
+			if ((maxiops = atoll(optarg)) <= 0)
+				errx(1, "%s: bad number of writes", optarg);
+			break;
+		case OPT_MAXRATE:
+			if ((maxrate = parsesize(optarg)) <= 0)
+				errx(1, "%s: bad size", optarg);
+			break;
+		case OPT_MAXLATENCY:
+			if ((maxlatency = atoi(optarg)) <= 0)
+				errx(1, "%s: bad latency", optarg);
+			break;
+		case OPT_IDLE:
+			idleio = 1;
+			break;
+		case OPT_FAULTS:
+			faultfile = optarg;
+			addfaults(faultfile);
+			break;
+		case OPT_MANIFEST:
+			manifest = optarg;
+			addmanifest(manifest, &targets, &ntargets);
+			break;
 		case '?':
 		default:
 			usage(prog_name);
@@ -227,60 +950,58 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
-		usage(prog_name);
-
-	special = argv[0];
-	if (!special[0])
-		err(1, "empty file/special name");
-	cp = strrchr(special, '/');
-	if (cp == NULL) {
-		/*
-		 * No path prefix; try prefixing _PATH_DEV.
-		 */
-		snprintf(device, sizeof(device), "%s%s", _PATH_DEV, special);
-		special = device;
+	/*
+	 * With SOURCE_DATE_EPOCH set, as with -R, the same options and
+	 * the same starting contents give the same image: all times are
+	 * taken from it, generation numbers are a hash of it and the
+	 * inode number and the group of .snap does not depend on the host.
+	 */
+	if ((cp = getenv("SOURCE_DATE_EPOCH")) != NULL) {
+		errno = 0;
+		sourcedate = strtoll(cp, &ep, 10);
+		if (errno != 0 || *cp == '\0' || *ep != '\0' || sourcedate < 0)
+			errx(1, "%s: bad SOURCE_DATE_EPOCH", cp);
+		randseed = sourcedate;
+		deterministic = 1;
 	}
+	if (Rflag)
+		deterministic = 1;
 
-
-	d_name = special;
-
-	d_fd = open(special, O_RDWR);
-	if (d_fd < 0 && !Nflag)
-		errx(1, "failed to open disk for writing %s: ", special);
-
-	#ifndef __linux__
-		#define BLKSSZGET 1
-		#define BLKGETSIZE64 2
-	#endif
-
-	if (sectorsize == 0)
-		if (ioctl(d_fd, BLKSSZGET, &sectorsize) == -1)
-		    	err(1, "can't get sector size");	
-	   
-	if (mediasize == 0)
-		if(ioctl(d_fd, BLKGETSIZE64, &mediasize) == -1)
-			err(1, "can't get media size");
-
-	fssize = mediasize / sectorsize - reserved;
-	if (fsize <= 0)
-		fsize = MAX(DFL_FRAGSIZE, sectorsize);
-	if (bsize <= 0)
-		bsize = MIN(DFL_BLKSIZE, 8 * fsize);
-	
-	/* Use soft updates by default for UFS2 and above */
-	if (Oflag > 1)
-		Uflag = 1;
-	realsectorsize = sectorsize;
-
-	mkfs(d_name);
-
-	close(d_fd);
-	
-
-    return 0;
-
-
+	/*
+	 * The devices come from the command line and any manifest.
+	 */
+	for (i = 0; i < (size_t)argc; i++) {
+		targets = realloc(targets, (ntargets + 1) * sizeof(*targets));
+		if (targets == NULL)
+			errx(1, "realloc failed");
+		targets[ntargets++] = argv[i];
+	}
+	if (ntargets == 0)
+		usage(prog_name);
+	if (ntargets > 1 && sparsesize > 0)
+		for (i = 0; i < (size_t)ntargets; i++)
+			if (strcmp(targets[i], "-") == 0)
+				errx(1, "a stream can only be made alone");
+	if (ntargets > 1 && hashfile != NULL && strcmp(hashfile, "-") != 0)
+		errx(1, "--hashes of several devices must go to standard output");
+	if (ntargets > 1 && tracefile != NULL)
+		errx(1, "--trace is for one device only");
+	if (ntargets > 1 && planfile != NULL)
+		errx(1, "--plan is for one device only");
+	if (faultfile != NULL && (sparsesize > 0 || mmapflag))
+		errx(1, "--faults is not usable with --sparse or --mmap");
+	if (tracefile != NULL)
+		traceopen(tracefile);
+	if (maxlatency > 0 && maxiops == 0 && maxrate == 0)
+		errx(1, "--max-latency needs --max-iops or --max-rate");
+	ratesetup();
+	if (ntargets == 1 && manifest == NULL) {
+		mkfsone(targets[0], reserved);
+		return (0);
+	}
+	if (jobs == 0)
+		jobs = MAX(1, sysconf(_SC_NPROCESSORS_ONLN));
+	return (mkfsbatch(targets, ntargets, jobs, reserved));
 }
 
 
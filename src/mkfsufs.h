@@ -44,6 +44,8 @@
 #include <sys/ioctl.h>
 #include <time.h>
 #include <grp.h>
+#include <getopt.h>
+#include <sched.h>
 
 
 /*
@@ -89,6 +91,15 @@ typedef int64_t ufs_time_t;
 
 
 #define SNAPLINKCNT 2
+#define PREALLOCMODE	0644
+#define SUJMODE		0400
+
+/*
+ * File flags of chflags(2) used on the journal file.
+ */
+#define	UF_NODUMP	0x00000001	/* do not dump file */
+#define	SF_IMMUTABLE	0x00020000	/* file may not be changed */
+#define	SF_NOUNLINK	0x00100000	/* file may not be removed or renamed */
 
 #define	FS_METACKHASH	0x00000200 /* kernel supports metadata check hashes */
 
@@ -105,6 +116,7 @@ typedef int64_t ufs_time_t;
 
 
 #define	DT_DIR		 4
+#define	DT_REG		 8
 #define	UFS_ROOTINO	((ino_t)2)
 /*
  * MINBSIZE is the smallest allowable block size.
@@ -180,6 +192,10 @@ int	Lflag;			/* add a volume label */
 int	Nflag;			/* run without writing file system */
 int Oflag = 2;		/* file system format (1 => UFS1, 2 => UFS2) */
 int	Rflag;			/* regression test */
+int	deterministic;		/* make the same image from the same input */
+time_t	sourcedate = -1;	/* SOURCE_DATE_EPOCH, if set */
+time_t	sbtime;			/* time stamped on superblocks, if fixed */
+uint64_t randseed;		/* seed of random numbers when deterministic */
 int	Uflag;			/* enable soft updates for file system */
 int	jflag;			/* enable soft updates journaling for filesys */
 int	Xflag = 0;		/* exit in middle of newfs for testing */
@@ -187,10 +203,19 @@ int	Jflag;			/* enable gjournal for file system */
 int	lflag;			/* enable multilabel for file system */
 int	nflag;			/* do not create .snap directory */
 int	tflag;			/* enable TRIM */
+int	verify;			/* check file system once created */
+int	prefill = 2;		/* UFS2 inode blocks written per group, -1 all */
+int	resume;			/* continue from the last checkpoint */
 intmax_t fssize;		/* file system size */
 off_t	mediasize;		/* device size */
 int	sectorsize;		/* bytes/sector */
 int	realsectorsize;		/* bytes/sector in hardware */
+int	physsectorsize;		/* bytes/physical sector, if known */
+int	iomin;			/* minimum I/O size (RAID chunk), if known */
+int	ioopt;			/* optimal I/O size (RAID stripe), if known */
+int	rotational;		/* device is known to be a rotating disk */
+int	numanode = -2;		/* NUMA node to run on, -1 for none, -2 the
+				   one of the device */
 int	fsize = 0;		/* fragment size */
 int	bsize = 0;		/* block size */
 int	maxbsize = 0;		/* maximum clustering */
@@ -204,12 +229,27 @@ int	maxbpg;			/* maximum blocks per file in a cyl group */
 int	avgfilesize = AVFILESIZ;/* expected average file size */
 int	avgfilesperdir = AFPDIR;/* expected number of files per directory */
 char	*volumelabel = NULL;	/* volume label for filesystem */
+
+/*
+ * Files to be created with contiguously allocated blocks.
+ */
+struct prealloc {
+	char	*pa_name;	/* path of file */
+	off_t	 pa_size;	/* size of file in bytes */
+	int	 pa_mode;	/* permissions of file */
+	uint32_t pa_flags;	/* file flags, see chflags(2) */
+	int	 pa_clear;	/* zero the contents of file */
+};
+struct	prealloc **preallocs;	/* files to preallocate */
+int	npreallocs;		/* number of files to preallocate */
 //struct uufsd disk;		/* libufs disk structure */
 
 
 
 
-ufs2_daddr_t part_ofs;
+ufs2_daddr_t part_ofs;		/* first sector of the file system */
+off_t	partoffset;		/* --offset of the file system in bytes */
+int	partindex = -1;		/* --partition, 0 for the first UFS one */
 
 int32_t d_fd;
 int d_bsize;
@@ -221,9 +261,21 @@ static struct	csum *fscs;
 const char * d_err;
 
 
-char *iobuf;
-static long iobufsize;
-static const char *failmsg;
+char	*d_map;			/* mapping of the image with --mmap */
+size_t	d_mapsize;		/* size of the mapping */
+int	mmapflag;		/* write the image through a mapping */
+char	*planfile;		/* list the planned writes in this file */
+char	*hashfile;		/* write the content hashes to this file */
+off_t	sparsesize;		/* make a sparse image of this many bytes */
+char	*tracefile;		/* write a trace of the format to this file */
+intmax_t maxiops;		/* writes per second allowed, 0 for any */
+intmax_t maxrate;		/* bytes per second allowed, 0 for any */
+int	maxlatency;		/* ms a write may take before slowing down */
+int	idleio;			/* write in the idle I/O scheduling class */
+char	*faultfile;		/* schedule of faults to inject in writes */
+
+long iobufsize;
+const char *failmsg;
 
 /*
  * Ensure that the buffer is aligned to the I/O subsystem requirements.
@@ -236,12 +288,60 @@ static const char *failmsg;
 }
 
 
-static u_int32_t
+u_int32_t
 newfs_random(void)
 {
 	static u_int32_t nextnum = 1;
 
 	if (Rflag)
 		return (nextnum++);
+	if (deterministic) {
+		/* 64-bit LCG of Knuth's MMIX, taking the high half */
+		randseed = randseed * 6364136223846793005ULL +
+		    1442695040888963407ULL;
+		return (randseed >> 32);
+	}
 	return (arc4random());
 }
+
+/*
+ * The number of processors the threads of this process may run on,
+ * which is fewer than are online once it is bound to a NUMA node.
+ */
+long
+ncpus(void)
+{
+#ifdef CPU_COUNT
+	cpu_set_t set;
+
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		return (CPU_COUNT(&set));
+#endif
+	return (sysconf(_SC_NPROCESSORS_ONLN));
+}
+
+/*
+ * Fill "v" with the generation numbers of the "n" inodes from "ino",
+ * taken from the system generator in a single call when they need not
+ * be reproducible. Reproducible ones are a hash of the seed and the
+ * inode number, so that they do not depend on the order the cylinder
+ * groups are made in or on the group a resumed format starts at.
+ */
+void
+newfs_randoms(u_int32_t *v, ino_t ino, int n)
+{
+	uint64_t z;
+	int i;
+
+	if (!Rflag && !deterministic) {
+		arc4random_buf(v, n * sizeof(*v));
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		/* The finalizer of SplitMix64 */
+		z = randseed + (ino + i + 1) * 0x9e3779b97f4a7c15ULL;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		v[i] = (z ^ (z >> 31)) >> 32;
+	}
+}
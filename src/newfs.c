@@ -75,6 +75,96 @@ charsperline(void)
 
 
 
+/*
+ * While the primary superblock still has FS_BAD_MAGIC, its fs_cgrotor
+ * records how many cylinder groups are known to be on disk, so that an
+ * interrupted format can be resumed. The cylinder groups are flushed
+ * before the count is written, so that it never runs ahead of them.
+ */
+#define	CKPTINTERVAL	5	/* seconds between checkpoints */
+#define	CGBATCH		256	/* most cylinder groups between checkpoints */
+
+static void
+ckptwrite(uint cg)
+{
+	struct fs *fs;
+
+	if ((errno = devsync(d_fd)) != 0)
+		err(1, "%s: %s", d_name, d_err);
+	if ((fs = calloc(1, SBLOCKSIZE)) == NULL)
+		errx(31, "calloc failed");
+	memcpy(fs, &sblock, sizeof(*fs));
+	fs->fs_si = NULL;
+	fs->fs_magic = FS_BAD_MAGIC;
+	fs->fs_cgrotor = cg;
+	wtfs(sblock.fs_sblockloc / sectorsize, sblock.fs_sbsize, (char *)fs);
+	free(fs);
+}
+
+/*
+ * Find the checkpoint of an interrupted format of the same file system
+ * and recover the summary of the cylinder groups it wrote, checking
+ * each of them on the way. Return the cylinder group to start from.
+ */
+static uint
+ckptread(time_t *utimep)
+{
+	struct fs *fs;
+	struct cg *cgp;
+	uint32_t ckhash;
+	uint cg;
+
+	if ((fs = aligned_alloc(LIBUFS_BUFALIGN, SBLOCKSIZE)) == NULL ||
+	    (cgp = aligned_alloc(LIBUFS_BUFALIGN, sblock.fs_bsize)) == NULL)
+		errx(31, "aligned_alloc failed");
+#define	SAME(field)	(fs->field == sblock.field)
+	if (bread(part_ofs + sblock.fs_sblockloc / sectorsize, fs,
+	    SBLOCKSIZE) == -1 || fs->fs_magic != FS_BAD_MAGIC ||
+	    fs->fs_cgrotor <= 0 || (uint32_t)fs->fs_cgrotor > sblock.fs_ncg ||
+	    !SAME(fs_size) || !SAME(fs_ncg) || !SAME(fs_fpg) ||
+	    !SAME(fs_ipg) || !SAME(fs_bsize) || !SAME(fs_fsize) ||
+	    !SAME(fs_sblkno) || !SAME(fs_cblkno) || !SAME(fs_iblkno) ||
+	    !SAME(fs_dblkno) || !SAME(fs_cgsize) || !SAME(fs_csaddr) ||
+	    !SAME(fs_cssize) || !SAME(fs_metaspace) || !SAME(fs_flags) ||
+	    !SAME(fs_metackhash) || !SAME(fs_contigsumsize) ||
+	    !SAME(fs_sblockloc)) {
+		warnx("%s: no checkpoint of this file system, starting over",
+		    d_name);
+		free(cgp);
+		free(fs);
+		return (0);
+	}
+#undef SAME
+	for (cg = 0; cg < (uint)fs->fs_cgrotor; cg++) {
+		if (bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, cg)), cgp,
+		    sblock.fs_cgsize) == -1 || cgp->cg_magic != CG_MAGIC ||
+		    cgp->cg_cgx != cg)
+			break;
+		if ((sblock.fs_metackhash & CK_CYLGRP) != 0) {
+			ckhash = cgp->cg_ckhash;
+			cgp->cg_ckhash = 0;
+			if (calculate_crc32c(~0L, (void *)cgp,
+			    sblock.fs_cgsize) != ckhash)
+				break;
+		}
+		fscs[cg] = cgp->cg_cs;
+	}
+	/*
+	 * The cylinder groups already written carry the time and the
+	 * identity of the original run, so keep using them.
+	 */
+	*utimep = fs->fs_id[0];
+	sblock.fs_id[0] = fs->fs_id[0];
+	sblock.fs_id[1] = fs->fs_id[1];
+	sblock.fs_time = *utimep;
+	if (Oflag == 1)
+		sblock.fs_old_time = *utimep;
+	printf("resuming at cylinder group %u of %u\n", cg, sblock.fs_ncg);
+	free(cgp);
+	free(fs);
+	return (cg);
+}
+
 void mkfs(char *fsys) {
 
 	time_t utime;
@@ -83,8 +173,12 @@ void mkfs(char *fsys) {
 	d_ufs = Oflag;
 	if (Rflag)
 		utime = 1000000000;
+	else if (sourcedate != -1)
+		utime = sourcedate;
 	else
 		time(&utime);
+	if (deterministic)
+		sbtime = utime;
 
    	if ((sblock.fs_si = (struct fs_summary_info *)malloc(sizeof(struct fs_summary_info))) == NULL) {
 		printf("Superblock summary info allocation failed.\n");
@@ -192,8 +286,18 @@ restart:
    * transfer size permitted by the controller or buffering.
    */
 
-	if (maxcontig == 0)
+	if (maxcontig == 0) {
 		maxcontig = MAX(1, MAXPHYS / bsize);
+		/*
+		 * Make clusters whole stripes of a RAID device.
+		 */
+		if (ioopt > 0 && ioopt % bsize == 0) {
+			if (ioopt / bsize <= maxcontig)
+				maxcontig -= maxcontig % (ioopt / bsize);
+			else
+				maxcontig = ioopt / bsize;
+		}
+	}
 	sblock.fs_maxcontig = maxcontig;
 	if (sblock.fs_maxcontig < sblock.fs_maxbsize / sblock.fs_bsize) {
 		sblock.fs_maxcontig = sblock.fs_maxbsize / sblock.fs_bsize;
@@ -365,11 +469,31 @@ retry:
 		break;
 	}
 
+	/*
+	 * On a RAID device make the cylinder groups a whole number of
+	 * stripes so that each of them starts on a stripe boundary,
+	 * unless a stripe is too large a part of a cylinder group.
+	 */
+	int stripefrags = 0;
+	if (ioopt > 0 && ioopt % sblock.fs_fsize == 0) {
+		stripefrags = ioopt / sblock.fs_fsize;
+		while (stripefrags % sblock.fs_frag != 0)
+			stripefrags += ioopt / sblock.fs_fsize;
+		if (stripefrags > sblock.fs_fpg / 2)
+			stripefrags = 0;
+	}
+	if (stripefrags > 0 && sblock.fs_fpg % stripefrags != 0) {
+		sblock.fs_fpg -= sblock.fs_fpg % stripefrags;
+		sblock.fs_ipg = roundup(howmany(sblock.fs_fpg, fragsperinode),
+		    INOPB(&sblock));
+	}
+
 	/*
 	 * Check to be sure that the last cylinder group has enough blocks
 	 * to be viable. If it is too small, reduce the number of blocks
 	 * per cylinder group which will have the effect of moving more
-	 * blocks into the last cylinder group.
+	 * blocks into the last cylinder group. Stripe alignment is given
+	 * up if it would take more than half of the cylinder group.
 	 */
 	
 	int optimalfpg = sblock.fs_fpg;
@@ -386,7 +510,12 @@ retry:
 		if (sblock.fs_size % sblock.fs_fpg >= lastminfpg ||
 		    sblock.fs_size % sblock.fs_fpg == 0)
 			break;
-		sblock.fs_fpg -= sblock.fs_frag;
+		if (stripefrags > 0 &&
+		    sblock.fs_fpg - stripefrags < optimalfpg / 2) {
+			stripefrags = 0;
+			sblock.fs_fpg = optimalfpg;
+		}
+		sblock.fs_fpg -= stripefrags > 0 ? stripefrags : sblock.fs_frag;
 		sblock.fs_ipg = roundup(howmany(sblock.fs_fpg, fragsperinode),
 		    INOPB(&sblock));
 	}
@@ -408,9 +537,8 @@ retry:
 	sblock.fs_csaddr = cgdmin(&sblock, 0);
 	sblock.fs_cssize =
 	    fragroundup(&sblock, sblock.fs_ncg * sizeof(struct csum));
-	fscs = (struct csum *)calloc(1, sblock.fs_cssize);
-	if (fscs == NULL)
-		errx(31, "calloc failed");
+	fscs = arenaalloc(&fmtarena, sblock.fs_cssize);
+	memset(fscs, 0, sblock.fs_cssize);
 	sblock.fs_sbsize = fragroundup(&sblock, sizeof(struct fs));
 	if (sblock.fs_sbsize > SBLOCKSIZE)
 		sblock.fs_sbsize = SBLOCKSIZE;
@@ -490,10 +618,62 @@ retry:
 	printf("\tusing %d cylinder groups of %.2fMB, %d blks, %d inodes.\n",
 	    sblock.fs_ncg, (float)sblock.fs_fpg * sblock.fs_fsize * B2MBFACTOR,
 	    sblock.fs_fpg / sblock.fs_frag, sblock.fs_ipg);
+	if (stripefrags > 0)
+		printf("\taligned to %d byte stripes\n", ioopt);
 	if (sblock.fs_flags & FS_DOSOFTDEP)
 		printf("\twith soft updates\n");
 #	undef B2MBFACTOR
 
+	/*
+	 * The soft updates journal is a contiguous file in the root
+	 * directory, sized as tunefs(8) would from the file system size.
+	 * It is entered first so that it takes the first inode after the
+	 * root and .snap directories.
+	 */
+	if (jflag) {
+		struct prealloc *pa;
+		struct fsnode *np;
+		int64_t jsize;
+
+		jsize = MIN(SUJ_MAX, (sblock.fs_size * sblock.fs_bsize) / 1024);
+		if (jsize / sblock.fs_fsize > sblock.fs_fpg)
+			jsize = sblock.fs_fpg * sblock.fs_fsize;
+		jsize = MAX(SUJ_MIN, jsize);
+		if ((pa = calloc(1, sizeof(*pa))) == NULL ||
+		    (preallocs = realloc(preallocs,
+		    (npreallocs + 1) * sizeof(*preallocs))) == NULL)
+			errx(31, "realloc failed");
+		preallocs[npreallocs++] = pa;
+		pa->pa_name = SUJ_FILE;
+		pa->pa_size = jsize;
+		pa->pa_mode = SUJMODE;
+		pa->pa_flags = SF_IMMUTABLE | SF_NOUNLINK | UF_NODUMP;
+		pa->pa_clear = 1;
+		np = fsenter(&fsroot, SUJ_FILE, DT_REG);
+		np->fn_pa = pa;
+		memmove(&fsroot.fn_child[1], &fsroot.fn_child[0],
+		    (fsroot.fn_nchild - 1) * sizeof(*fsroot.fn_child));
+		fsroot.fn_child[0] = np;
+		sblock.fs_flags |= FS_SUJ;
+		sblock.fs_sujfree = 0;
+		printf("\twith soft updates journaling (%jd byte journal)\n",
+		    (intmax_t)jsize);
+	}
+
+	/*
+	 * Preallocated files are rounded up to whole blocks. Make sure
+	 * that they and the directory tree fit before anything is written.
+	 */
+	for (i = 0; i < npreallocs; i++) {
+		preallocs[i]->pa_size = blkroundup(&sblock, preallocs[i]->pa_size);
+		if ((uint64_t)preallocs[i]->pa_size > sblock.fs_maxfilesize)
+			errx(46, "%s: preallocated file too large",
+			    preallocs[i]->pa_name);
+	}
+	fscheck();
+	if (fsnnodes > sblock.fs_cstotal.cs_nifree - UFS_ROOTINO - 2)
+		errx(46, "not enough inodes for the directory tree");
+
 	if (Eflag && !Nflag) {
 	/* 	printf("Erasing sectors [%jd...%jd]\n", 
 		    sblock.fs_sblockloc / bsize,
@@ -502,13 +682,36 @@ retry:
 		    sblock.fs_size * sblock.fs_fsize - sblock.fs_sblockloc); */
 	}
 
+	/*
+	 * Pick up where an interrupted format left off. The primary
+	 * superblock written next keeps the checkpoint.
+	 */
+	uint firstcg = 0;
+	if (resume && !Nflag)
+		firstcg = ckptread(&utime);
+	sblock.fs_cgrotor = firstcg;
+
+	/*
+	 * From here on the writes go through the write plan.
+	 */
+	if (!Nflag && d_map == NULL)
+		planopen();
+
 	/*
 	 * Reference the summary information so it will also be written.
 	 */
 	sblock.fs_csp = fscs;
 	if (!Nflag && sbwrite(0) != 0)
 		err(1, "sbwrite: %s", d_err);
+	/* The backups do not keep it, as in a format that was not resumed. */
+	sblock.fs_cgrotor = 0;
+	/*
+	 * The superblock with FS_BAD_MAGIC goes in an epoch of its own,
+	 * ahead of any cylinder group.
+	 */
+	planfence();
 	if (Xflag == 1) {
+		planclose();
 		printf("** Exiting on Xflag 1\n");
 		exit(0);
 	}
@@ -527,39 +730,71 @@ retry:
 
 
 	/*
-	 * Allocate space for two sets of inode blocks.
+	 * initcg() writes the inodes of a cylinder group up to MAXPHYS
+	 * bytes at a time.
 	 */
-	iobufsize = 2 * sblock.fs_bsize;
-	if ((iobuf = calloc(1, iobufsize)) == 0) {
-		printf("Cannot allocate I/O buffer\n");
-		exit(38);
-	}
+	iobufsize = MAX(2 * sblock.fs_bsize, MAXPHYS);
 
 	/*
-	 * Write out all the cylinder groups and backup superblocks.
+	 * Write out all the cylinder groups and backup superblocks in
+	 * batches, two for each thread of initcgs(), checkpointing between
+	 * batches.
 	 */
-	uint cg, j;
+	uint batch = MIN(CGBATCH, 2 * ncpus());
+	uint cg, j, next;
 	char tmpbuf[100];
-	for (cg = 0; cg < sblock.fs_ncg; cg++) {
-		if (!Nflag)
-			initcg(cg, utime);
-		j = snprintf(tmpbuf, sizeof(tmpbuf), " %jd%s",
-		    (intmax_t)fsbtodb(&sblock, cgsblock(&sblock, cg)),
-		    cg < (sblock.fs_ncg-1) ? "," : "");
-		if (j < 0)
-			tmpbuf[j = 0] = '\0';
-		if (i + j >= width) {
-			printf("\n");
-			i = 0;
+	time_t ckpt = time(NULL);
+	int ckpted = firstcg > 0;
+	for (cg = 0; cg < sblock.fs_ncg; cg = next) {
+		next = MIN(cg + batch, sblock.fs_ncg);
+		if (!Nflag && cg > firstcg && time(NULL) - ckpt >= CKPTINTERVAL) {
+			ckptwrite(cg);
+			ckpt = time(NULL);
+			ckpted = 1;
+		}
+		if (!Nflag && next > firstcg)
+			initcgs(MAX(cg, firstcg), next, utime);
+		if (d_map != NULL)
+			mapflush((part_ofs + fsbtodb(&sblock,
+			    cgbase(&sblock, cg))) * sectorsize,
+			    (part_ofs + fsbtodb(&sblock, cgbase(&sblock,
+			    next))) * sectorsize);
+		for (; cg < next; cg++) {
+			j = snprintf(tmpbuf, sizeof(tmpbuf), " %jd%s",
+			    (intmax_t)fsbtodb(&sblock, cgsblock(&sblock, cg)),
+			    cg < (sblock.fs_ncg-1) ? "," : "");
+			if (j < 0)
+				tmpbuf[j = 0] = '\0';
+			if (i + j >= width) {
+				printf("\n");
+				i = 0;
+			}
+			i += j;
+			printf("%s", tmpbuf);
 		}
-		i += j;
-		printf("%s", tmpbuf);
 		fflush(stdout);
 	}
 	printf("\n");
 	if (Nflag)
 		exit(0);
+	sblock.fs_cgrotor = 0;
 
+	/*
+	 * Take the totals from the cylinder groups as they were made.
+	 */
+	cssum(fscs, sblock.fs_ncg, &sblock.fs_cstotal);
+
+
+	/*
+	 * fsinit() changes cylinder groups that a checkpoint on the disk
+	 * counts as fresh, which a resumed format would take as they are
+	 * and allocate from again. Withdraw it before they are touched.
+	 */
+	if (ckpted) {
+		ckptwrite(0);
+		if ((errno = devsync(d_fd)) != 0)
+			err(1, "%s: %s", d_name, d_err);
+	}
 
 	/*
 	 * Now construct the initial file system,
@@ -573,6 +808,7 @@ retry:
 		sblock.fs_old_cstotal.cs_nffree = sblock.fs_cstotal.cs_nffree;
 	}
 	if (Xflag == 3) {
+		planclose();
 		printf("** Exiting on Xflag 3\n");
 		exit(0);
 	}
@@ -620,6 +856,7 @@ retry:
 	wtfs((SBLOCK_UFS2 - realsectorsize) / d_bsize,
 	    realsectorsize, fsrbuf);
 	free(fsrbuf);
+	planclose();
 
 	/*
 	 * This should NOT happen. If it does complain loudly and
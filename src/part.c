@@ -0,0 +1,185 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Locate the partition of a whole disk or disk image that the file
+ * system is to be made in, from its GPT or MBR or from an offset given
+ * on the command line. Partition tables count in logical sectors of
+ * the device, as does part_ofs.
+ */
+
+#include <endian.h>
+
+#define	MBR_SIGOFF	510		/* offset of 0x55 0xaa signature */
+#define	MBR_PARTOFF	446		/* offset of partition table */
+#define	MBR_NPARTS	4
+#define	MBR_PTYPE_FREEBSD 0xa5		/* FreeBSD slice */
+#define	MBR_PTYPE_PMBR	0xee		/* protective MBR of a GPT disk */
+
+#define	GPT_SIG		"EFI PART"
+#define	GPT_MINHDRSIZE	92
+#define	GPT_MAXENTS	4096
+
+/* 516e7cb6-6ecf-11d6-8ff8-00022d09712b as stored on disk */
+static const uint8_t gpt_freebsd_ufs[16] = {
+	0xb6, 0x7c, 0x6e, 0x51, 0xcf, 0x6e, 0xd6, 0x11,
+	0x8f, 0xf8, 0x00, 0x02, 0x2d, 0x09, 0x71, 0x2b
+};
+
+static void
+partread(uint64_t sector, void *buf, size_t size)
+{
+
+	if (dpread(d_fd, buf, size, (off_t)sector * sectorsize) !=
+	    (ssize_t)size)
+		err(1, "%s: can't read partition table", d_name);
+}
+
+/*
+ * The CRC-32 of a GPT header, done a bit at a time as it is only run
+ * once on less than a sector.
+ */
+static uint32_t
+gptcrc(const uint8_t *p, size_t size)
+{
+	uint32_t crc;
+	int i;
+
+	for (crc = ~0U; size > 0; size--) {
+		crc ^= *p++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	return (~crc);
+}
+
+/*
+ * Find partition "index", counting from 1, or the first FreeBSD UFS
+ * partition if index is 0, in the GPT that starts at sector 1.
+ */
+static int
+findgpt(int index, ufs2_daddr_t *startp, ufs2_daddr_t *sizep)
+{
+	uint8_t *hdr, *ents, *ent;
+	uint64_t entlba;
+	uint32_t i, nents, entsize, hdrsize, crc;
+
+	if ((hdr = malloc(sectorsize)) == NULL)
+		errx(31, "malloc failed");
+	partread(1, hdr, sectorsize);
+	hdrsize = le32toh(*(uint32_t *)&hdr[12]);
+	if (memcmp(hdr, GPT_SIG, 8) != 0 || hdrsize < GPT_MINHDRSIZE ||
+	    hdrsize > (uint32_t)sectorsize)
+		errx(1, "%s: no GPT header", d_name);
+	crc = le32toh(*(uint32_t *)&hdr[16]);
+	memset(&hdr[16], 0, 4);
+	if (gptcrc(hdr, hdrsize) != crc)
+		errx(1, "%s: GPT header check-hash failed", d_name);
+	entlba = le64toh(*(uint64_t *)&hdr[72]);
+	nents = le32toh(*(uint32_t *)&hdr[80]);
+	entsize = le32toh(*(uint32_t *)&hdr[84]);
+	free(hdr);
+	if (nents > GPT_MAXENTS || entsize < 128 || entsize % 8 != 0)
+		errx(1, "%s: bad GPT partition table", d_name);
+	if ((ents = malloc(roundup(nents * entsize, sectorsize))) == NULL)
+		errx(31, "malloc failed");
+	partread(entlba, ents, roundup(nents * entsize, sectorsize));
+	for (i = 0; i < nents; i++) {
+		ent = &ents[i * entsize];
+		if (index != 0 ? i + 1 != (uint32_t)index :
+		    memcmp(ent, gpt_freebsd_ufs, 16) != 0)
+			continue;
+		*startp = le64toh(*(uint64_t *)&ent[32]);
+		*sizep = le64toh(*(uint64_t *)&ent[40]) - *startp + 1;
+		free(ents);
+		return (*sizep > 0 && *startp > 0);
+	}
+	free(ents);
+	return (0);
+}
+
+/*
+ * Find partition "index", counting from 1, or the first FreeBSD UFS
+ * partition if index is 0, in the GPT or the MBR of the device.
+ */
+void
+findpart(int index, ufs2_daddr_t *startp, ufs2_daddr_t *sizep)
+{
+	uint8_t *mbr, *ent;
+	int i, found;
+
+	if ((mbr = malloc(sectorsize)) == NULL)
+		errx(31, "malloc failed");
+	partread(0, mbr, sectorsize);
+	if (mbr[MBR_SIGOFF] != 0x55 || mbr[MBR_SIGOFF + 1] != 0xaa)
+		errx(1, "%s: no partition table", d_name);
+	found = 0;
+	for (i = 0; i < MBR_NPARTS && !found; i++) {
+		ent = &mbr[MBR_PARTOFF + 16 * i];
+		if (ent[4] == MBR_PTYPE_PMBR) {
+			found = findgpt(index, startp, sizep);
+			break;
+		}
+		if (index != 0 ? i + 1 != index : ent[4] != MBR_PTYPE_FREEBSD)
+			continue;
+		*startp = le32toh(*(uint32_t *)&ent[8]);
+		*sizep = le32toh(*(uint32_t *)&ent[12]);
+		found = *sizep > 0 && *startp > 0;
+	}
+	free(mbr);
+	if (!found) {
+		if (index != 0)
+			errx(1, "%s: no partition %d", d_name, index);
+		errx(1, "%s: no FreeBSD UFS partition", d_name);
+	}
+}
+
+/*
+ * Confine the file system to the partition given by --partition or
+ * --offset: set part_ofs and cut mediasize down to the partition.
+ */
+void
+usepart(void)
+{
+	ufs2_daddr_t start, size;
+
+	if (partindex >= 0) {
+		findpart(partindex, &start, &size);
+	} else {
+		if (partoffset % sectorsize != 0)
+			errx(1, "%s: offset %jd is not a multiple of the "
+			    "sector size %d", d_name, (intmax_t)partoffset,
+			    sectorsize);
+		start = partoffset / sectorsize;
+		size = mediasize / sectorsize - start;
+	}
+	if (size <= 0 || (start + size) * sectorsize > mediasize)
+		errx(1, "%s: partition at sector %jd does not fit the device",
+		    d_name, (intmax_t)start);
+	part_ofs = start;
+	mediasize = size * sectorsize;
+	printf("%s: using %jd sectors from sector %jd\n", d_name,
+	    (intmax_t)size, (intmax_t)start);
+}
@@ -0,0 +1,360 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * The write plan. While it is open, the writes of a format are not
+ * issued as they are made but recorded, each with a copy of its data
+ * and an epoch. The records of an epoch may be written in any order
+ * but only once all of those of the earlier epochs are written, which
+ * is how the few ordering constraints, such as the primary superblock
+ * going last, are kept. When it is run the plan is sorted by epoch and
+ * offset, adjacent records are joined into writes of up to MAXPHYS, and
+ * the writes of an epoch are issued by several threads unless the disk
+ * is a rotating one or a sparse image is being made. Reads run the plan
+ * first, so that they see what has been written.
+ */
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define	PLANMAX		(32 * 1024 * 1024) /* bytes held before a run */
+#define	PLANBATCH	16		/* writes taken by a thread at once */
+#define	MAXPLANTHREADS	8
+#define	MAXPLANIOV	64		/* records joined into one write */
+
+struct wrec {
+	off_t		 w_off;		/* byte offset on the device */
+	size_t		 w_len;		/* length in bytes */
+	char		*w_buf;		/* private copy of the data */
+	uint32_t	 w_epoch;	/* written after all earlier epochs */
+	uint32_t	 w_seq;		/* order in which it was planned */
+};
+
+/*
+ * A write of one or more adjacent records of an epoch.
+ */
+struct wext {
+	off_t		 we_off;	/* byte offset on the device */
+	size_t		 we_len;	/* total length in bytes */
+	int		 we_first;	/* first record */
+	int		 we_nrec;	/* number of records */
+};
+
+static struct {
+	struct wrec	*wp_rec;	/* records not yet written */
+	int		 wp_nrec;
+	int		 wp_maxrec;
+	size_t		 wp_bytes;	/* bytes held by wp_rec */
+	uint32_t	 wp_epoch;	/* epoch of new records */
+	uint32_t	 wp_seq;	/* sequence number of the next record */
+	int		 wp_open;	/* writes are being planned */
+	FILE		*wp_dump;	/* where to list the writes, if anywhere */
+	struct wext	*wp_ext;	/* the writes of the epoch being run */
+	int		 wp_next;	/* next of them to be issued */
+	int		 wp_last;
+	int		 wp_error;	/* errno of the first failed write */
+	off_t		 wp_erroff;	/* its offset */
+	ssize_t		 wp_errn;	/* and what it returned */
+	pthread_mutex_t	 wp_lock;
+} plan = { .wp_lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * The copies of the data of the records, recycled each time the plan
+ * is run. Records are only added with the plan locked.
+ */
+struct arena planarena = { 1, 1, 2 * PLANMAX + 4 * MAXPHYS, NULL, 0, 1, 0,
+    PTHREAD_MUTEX_INITIALIZER };
+
+static int
+wreccmp(const void *a, const void *b)
+{
+	const struct wrec *ra = a, *rb = b;
+
+	if (ra->w_epoch != rb->w_epoch)
+		return (ra->w_epoch < rb->w_epoch ? -1 : 1);
+	if (ra->w_off != rb->w_off)
+		return (ra->w_off < rb->w_off ? -1 : 1);
+	return (ra->w_seq < rb->w_seq ? -1 : ra->w_seq > rb->w_seq);
+}
+
+static int
+wreqseq(const void *a, const void *b)
+{
+	const struct wrec *ra = a, *rb = b;
+
+	return (ra->w_seq < rb->w_seq ? -1 : ra->w_seq > rb->w_seq);
+}
+
+static void *
+planworker(void *arg)
+{
+	struct iovec iov[MAXPLANIOV];
+	struct wext *we;
+	uint64_t start;
+	int e, i, n, last;
+
+	while (__atomic_load_n(&plan.wp_error, __ATOMIC_RELAXED) == 0 &&
+	    (e = __atomic_fetch_add(&plan.wp_next, PLANBATCH,
+	    __ATOMIC_RELAXED)) < plan.wp_last) {
+		last = MIN(e + PLANBATCH, plan.wp_last);
+		for (; e < last; e++) {
+			we = &plan.wp_ext[e];
+			for (i = 0; i < we->we_nrec; i++) {
+				iov[i].iov_base = plan.wp_rec[we->we_first +
+				    i].w_buf;
+				iov[i].iov_len = plan.wp_rec[we->we_first +
+				    i].w_len;
+			}
+			start = tracestart();
+			n = dpwritev(d_fd, iov, we->we_nrec, we->we_off);
+			trace("pwritev", start, "offset", we->we_off, "size",
+			    we->we_len);
+			if (n == -1 || (size_t)n != we->we_len) {
+				if (__atomic_compare_exchange_n(&plan.wp_error,
+				    &(int){ 0 }, n == -1 ? errno : EIO, 0,
+				    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+					plan.wp_erroff = we->we_off;
+					plan.wp_errn = n;
+				}
+				break;
+			}
+		}
+	}
+	return (arg);
+}
+
+/*
+ * Issue the writes of records first through last - 1, all of one epoch.
+ * A record that overlaps another could be overtaken by an older one if
+ * they were written in order of offset, so an epoch with any overlap
+ * is written one record at a time in the order it was planned.
+ */
+static int
+planepoch(int first, int last)
+{
+	pthread_t threads[MAXPLANTHREADS];
+	struct wrec *wr;
+	struct wext *we;
+	off_t end;
+	long nthreads;
+	int i, n, overlap, error;
+
+	end = 0;
+	overlap = 0;
+	for (i = first; i < last && !overlap; i++) {
+		overlap = i > first && plan.wp_rec[i].w_off < end;
+		end = MAX(end, plan.wp_rec[i].w_off +
+		    (off_t)plan.wp_rec[i].w_len);
+	}
+	if (overlap)
+		qsort(&plan.wp_rec[first], last - first, sizeof(*plan.wp_rec),
+		    wreqseq);
+	n = 0;
+	for (i = first; i < last; i++) {
+		wr = &plan.wp_rec[i];
+		we = n > 0 ? &plan.wp_ext[n - 1] : NULL;
+		if (we != NULL && !overlap && wr->w_off == we->we_off + (off_t)we->we_len &&
+		    we->we_len + wr->w_len <= MAXPHYS &&
+		    we->we_nrec < MAXPLANIOV) {
+			we->we_len += wr->w_len;
+			we->we_nrec++;
+			continue;
+		}
+		we = &plan.wp_ext[n++];
+		we->we_off = wr->w_off;
+		we->we_len = wr->w_len;
+		we->we_first = i;
+		we->we_nrec = 1;
+	}
+	if (plan.wp_dump != NULL)
+		for (i = 0; i < n; i++)
+			fprintf(plan.wp_dump, "%u %jd %zu %d\n",
+			    plan.wp_rec[plan.wp_ext[i].we_first].w_epoch,
+			    (intmax_t)plan.wp_ext[i].we_off,
+			    plan.wp_ext[i].we_len, plan.wp_ext[i].we_nrec);
+	plan.wp_next = 0;
+	plan.wp_last = n;
+	plan.wp_error = 0;
+	nthreads = 1;
+	if (!rotational && !overlap && !sparse.sp_open)
+		nthreads = MAX(1, MIN(ncpus(),
+		    MIN(MAXPLANTHREADS, howmany(n, PLANBATCH))));
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, planworker,
+		    NULL)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	planworker(NULL);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	return (plan.wp_error);
+}
+
+/*
+ * Write out everything planned so far, epoch by epoch. The plan is
+ * locked by the caller.
+ */
+static int
+planrun1(void)
+{
+	int first, last, error;
+
+	if (plan.wp_nrec == 0)
+		return (0);
+	if ((plan.wp_ext = calloc(plan.wp_nrec, sizeof(*plan.wp_ext))) ==
+	    NULL)
+		errx(31, "calloc failed");
+	qsort(plan.wp_rec, plan.wp_nrec, sizeof(*plan.wp_rec), wreccmp);
+	error = 0;
+	for (first = 0; first < plan.wp_nrec && error == 0; first = last) {
+		for (last = first + 1; last < plan.wp_nrec &&
+		    plan.wp_rec[last].w_epoch == plan.wp_rec[first].w_epoch;
+		    last++)
+			continue;
+		error = planepoch(first, last);
+	}
+	for (first = 0; first < plan.wp_nrec; first++)
+		arenafree(&planarena, plan.wp_rec[first].w_buf);
+	arenareset(&planarena);
+	free(plan.wp_ext);
+	plan.wp_ext = NULL;
+	plan.wp_nrec = 0;
+	plan.wp_bytes = 0;
+	/* What is planned next goes after all this, in the dump as well. */
+	plan.wp_epoch++;
+	return (error);
+}
+
+/*
+ * Report the first write of a run that failed, or wrote short, in errno
+ * and d_err.
+ */
+static int
+planerr(int error)
+{
+	static char msg[80];
+
+	snprintf(msg, sizeof(msg), "%s to block device at byte %jd",
+	    plan.wp_errn == -1 ? "write error" : "short write",
+	    (intmax_t)plan.wp_erroff);
+	errno = error;
+	d_err = msg;
+	return (-1);
+}
+
+int
+planrun(void)
+{
+	int error;
+
+	pthread_mutex_lock(&plan.wp_lock);
+	error = planrun1();
+	pthread_mutex_unlock(&plan.wp_lock);
+	if (error != 0)
+		return (planerr(error));
+	return (0);
+}
+
+/*
+ * Record a write of size bytes at byte offset off. Its data is copied,
+ * so buf may be reused as soon as this returns.
+ */
+int
+planadd(off_t off, const void *buf, size_t size)
+{
+	struct wrec *wr;
+	int error;
+
+	error = 0;
+	pthread_mutex_lock(&plan.wp_lock);
+	if (plan.wp_bytes + size > PLANMAX)
+		error = planrun1();
+	if (plan.wp_nrec == plan.wp_maxrec) {
+		plan.wp_maxrec = MAX(1024, 2 * plan.wp_maxrec);
+		if ((plan.wp_rec = realloc(plan.wp_rec,
+		    plan.wp_maxrec * sizeof(*plan.wp_rec))) == NULL)
+			errx(31, "realloc failed");
+	}
+	wr = &plan.wp_rec[plan.wp_nrec];
+	wr->w_buf = arenaalloc(&planarena, size);
+	memcpy(wr->w_buf, buf, size);
+	wr->w_off = off;
+	wr->w_len = size;
+	wr->w_epoch = plan.wp_epoch;
+	wr->w_seq = plan.wp_seq++;
+	plan.wp_nrec++;
+	plan.wp_bytes += size;
+	pthread_mutex_unlock(&plan.wp_lock);
+	if (error != 0)
+		return (planerr(error));
+	return (0);
+}
+
+/*
+ * Writes planned from now on go after all of those planned so far.
+ */
+void
+planfence(void)
+{
+
+	pthread_mutex_lock(&plan.wp_lock);
+	if (plan.wp_nrec > 0)
+		plan.wp_epoch++;
+	pthread_mutex_unlock(&plan.wp_lock);
+}
+
+/*
+ * Start planning writes, listing them in the file named by planfile
+ * as they are issued if one was given: one line for each write, with
+ * its epoch, byte offset, length and number of records joined in it.
+ */
+void
+planopen(void)
+{
+
+	if (plan.wp_open)
+		return;
+	if (planfile != NULL && plan.wp_dump == NULL) {
+		if (strcmp(planfile, "-") == 0)
+			plan.wp_dump = stdout;
+		else if ((plan.wp_dump = fopen(planfile, "w")) == NULL)
+			err(1, "%s", planfile);
+	}
+	plan.wp_open = 1;
+}
+
+void
+planclose(void)
+{
+
+	if (!plan.wp_open)
+		return;
+	if (planrun() != 0)
+		err(36, "%s", d_err);
+	plan.wp_open = 0;
+	if (plan.wp_dump != NULL && plan.wp_dump != stdout)
+		fclose(plan.wp_dump);
+	plan.wp_dump = NULL;
+}
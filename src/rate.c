@@ -0,0 +1,164 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * A limit on the rate of the writes made to a device, for a format on a
+ * host that is serving from other disks behind the same controller.
+ * Two token buckets, of writes and of bytes, fill at maxiops and maxrate
+ * a second and hold RATEBURST ns worth. Every write takes its tokens
+ * under the lock, going into debt if need be, and then sleeps outside
+ * it until the debt has been paid, so concurrent writers are spaced out
+ * in the order they came.
+ *
+ * With maxlatency the rates follow the device: a write that takes
+ * longer halves them, at most once per RATEBURST and not below
+ * RATEMINSCALE of the caps, and each write that does not takes them
+ * back up by RATESTEP of the caps.
+ */
+
+#include <pthread.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+#define	RATEBURST	100000000	/* ns of tokens a bucket holds */
+#define	RATEMINSCALE	(1.0 / 64)
+#define	RATESTEP	(1.0 / 64)
+
+#ifndef IOPRIO_CLASS_IDLE
+#define	IOPRIO_WHO_PROCESS	1
+#define	IOPRIO_CLASS_IDLE	3
+#define	IOPRIO_CLASS_SHIFT	13
+#endif
+
+static struct {
+	pthread_mutex_t	rl_lock;
+	int		rl_on;		/* writes are being limited */
+	uint64_t	rl_last;	/* when the buckets were filled */
+	uint64_t	rl_cut;		/* when the rates were halved */
+	double		rl_scale;	/* fraction of the caps allowed */
+	double		rl_ops;		/* tokens in the buckets */
+	double		rl_bytes;
+} rl = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 1.0, 0, 0 };
+
+/*
+ * Add the tokens earned since the last fill, up to RATEBURST worth.
+ */
+static void
+ratefill(uint64_t now)
+{
+	double ns;
+
+	ns = now - rl.rl_last;
+	rl.rl_last = now;
+	if (maxiops > 0)
+		rl.rl_ops = MIN(rl.rl_ops + ns * maxiops * rl.rl_scale / 1e9,
+		    (double)RATEBURST * maxiops * rl.rl_scale / 1e9);
+	if (maxrate > 0)
+		rl.rl_bytes = MIN(rl.rl_bytes + ns * maxrate * rl.rl_scale /
+		    1e9, (double)RATEBURST * maxrate * rl.rl_scale / 1e9);
+}
+
+/*
+ * Start limiting the writes, if asked to, and drop to the idle I/O
+ * class, which the BFQ scheduler serves only when the disks are
+ * otherwise idle.
+ */
+void
+ratesetup(void)
+{
+
+	if (idleio) {
+#ifdef SYS_ioprio_set
+		if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		    IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) == -1)
+			warn("ioprio_set");
+#else
+		warnx("no I/O scheduling classes, --idle ignored");
+#endif
+	}
+	if (maxiops <= 0 && maxrate <= 0)
+		return;
+	rl.rl_cut = tracenow();
+	rl.rl_last = rl.rl_cut - RATEBURST;
+	ratefill(rl.rl_cut);
+	rl.rl_on = 1;
+}
+
+/*
+ * Wait for the tokens for a write of size bytes. Return the time the
+ * write may start, to be handed to ratedone(), or 0 when not limiting.
+ */
+uint64_t
+ratewait(size_t size)
+{
+	struct timespec ts;
+	uint64_t now, start;
+	double ns;
+
+	if (!rl.rl_on)
+		return (0);
+	start = tracestart();
+	pthread_mutex_lock(&rl.rl_lock);
+	now = tracenow();
+	ratefill(now);
+	ns = 0;
+	if (maxiops > 0 && (rl.rl_ops -= 1) < 0)
+		ns = -rl.rl_ops * 1e9 / (maxiops * rl.rl_scale);
+	if (maxrate > 0 && (rl.rl_bytes -= size) < 0)
+		ns = MAX(ns, -rl.rl_bytes * 1e9 / (maxrate * rl.rl_scale));
+	pthread_mutex_unlock(&rl.rl_lock);
+	if (ns < 1000)
+		return (now);
+	ts.tv_sec = ns / 1e9;
+	ts.tv_nsec = ns - ts.tv_sec * 1e9;
+	while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+		continue;
+	trace("throttle", start, "size", size, "scale",
+	    (int64_t)(rl.rl_scale * 1000));
+	return (tracenow());
+}
+
+/*
+ * Note that a write that started at start, as returned by ratewait(),
+ * is done, and adjust the rates to how long it took.
+ */
+void
+ratedone(uint64_t start)
+{
+	uint64_t now;
+
+	if (start == 0 || maxlatency <= 0)
+		return;
+	now = tracenow();
+	pthread_mutex_lock(&rl.rl_lock);
+	if (now - start > (uint64_t)maxlatency * 1000000) {
+		if (now - rl.rl_cut >= RATEBURST) {
+			rl.rl_scale = MAX(rl.rl_scale / 2, RATEMINSCALE);
+			rl.rl_cut = now;
+		}
+	} else
+		rl.rl_scale = MIN(rl.rl_scale + RATESTEP, 1.0);
+	pthread_mutex_unlock(&rl.rl_lock);
+}
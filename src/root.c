@@ -47,12 +47,6 @@ struct direct {
 					/* name with length <= UFS_MAXNAMLEN */
 };
 
-static struct direct root_dir[] = {
-	{ UFS_ROOTINO, sizeof(struct direct), DT_DIR, 1, "." },
-	{ UFS_ROOTINO, sizeof(struct direct), DT_DIR, 2, ".." },
-	{ UFS_ROOTINO + 1, sizeof(struct direct), DT_DIR, 5, ".snap" },
-};
-
 static struct direct snap_dir[] = {
 	{ UFS_ROOTINO + 1, sizeof(struct direct), DT_DIR, 1, "." },
 	{ UFS_ROOTINO, sizeof(struct direct), DT_DIR, 2, ".." },
@@ -84,254 +78,980 @@ clrblock(struct fs *fs, unsigned char *cp, int h)
 	}
 }
 
+
+#define	DIP_SET(dp, field, val) do {					\
+	if (sblock.fs_magic == FS_UFS1_MAGIC)				\
+		(dp)->dp1.field = (val);				\
+	else								\
+		(dp)->dp2.field = (val);				\
+} while (0)
+
 /*
- * check if a block is available
+ * Cylinder groups changed by fsinit() are kept in memory and written
+ * back once by cgflush(), rather than being read and written again
+ * for every inode and block that is allocated.
  */
-static int
-isblock(struct fs *fs, unsigned char *cp, int h)
+static struct cg **cgcache;
+
+static struct cg *
+cgget(int cylno)
 {
-	unsigned char mask;
+	struct cg *cgp;
 
-	switch (fs->fs_frag) {
-	case 8:
-		return (cp[h] == 0xff);
-	case 4:
-		mask = 0x0f << ((h & 0x1) << 2);
-		return ((cp[h >> 1] & mask) == mask);
-	case 2:
-		mask = 0x03 << ((h & 0x3) << 1);
-		return ((cp[h >> 2] & mask) == mask);
-	case 1:
-		mask = 0x01 << (h & 0x7);
-		return ((cp[h >> 3] & mask) == mask);
-	default:
-		fprintf(stderr, "isblock bad fs_frag %d\n", fs->fs_frag);
-		return (0);
+	if (cgcache == NULL &&
+	    (cgcache = calloc(sblock.fs_ncg, sizeof(*cgcache))) == NULL)
+		errx(42, "calloc failed");
+	if ((cgp = cgcache[cylno]) != NULL)
+		return (cgp);
+	cgp = mapaddr((part_ofs + fsbtodb(&sblock, cgtod(&sblock, cylno))) *
+	    sectorsize, sblock.fs_cgsize);
+	if (cgp == NULL)
+		cgp = arenaalloc(&fmtarena, sblock.fs_cgsize);
+	if (d_map == NULL && bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, cylno)),
+	    (char *)cgp, sblock.fs_cgsize) == -1)
+		errx(38, "cg %d: %s", cylno, d_err);
+	if (cgp->cg_magic != CG_MAGIC) {
+		printf("cg %d: bad magic number\n", cylno);
+		exit(38);
 	}
+	cgcache[cylno] = cgp;
+	return (cgp);
+}
+
+static void
+cgflush(void)
+{
+	uint cylno;
+
+	if (cgcache == NULL)
+		return;
+	for (cylno = 0; cylno < sblock.fs_ncg; cylno++) {
+		if (cgcache[cylno] == NULL)
+			continue;
+		if (sblock.fs_contigsumsize > 0)
+			clustersum(&sblock, cgcache[cylno]);
+		if (cgwrite1(cgcache[cylno]) != 0)
+			err(1, "cgflush: cgwrite: %s", d_err);
+		if (d_map == NULL)
+			arenafree(&fmtarena, cgcache[cylno]);
+	}
+	free(cgcache);
+	cgcache = NULL;
 }
 
 /*
- * allocate a block or frag
+ * Inode blocks are cached the same way, in an array of blocks for each
+ * cylinder group. In UFS2 a block beyond cg_initediblk is initialized
+ * here instead of being read, just as the kernel does when it first
+ * allocates an inode in it.
  */
-ufs2_daddr_t
-alloc(int size, int mode)
+static char ***inocache;
+
+static char *
+inoblk(ino_t ino)
 {
-	int i, blkno, frag;
-	uint d;
+	struct cg *cgp;
+	char *bp;
+	int cylno, blk;
 
-	bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, 0)), (char *)&acg,
-	    sblock.fs_cgsize);
-	if (acg.cg_magic != CG_MAGIC) {
-		printf("cg 0: bad magic number\n");
-		exit(38);
+	cylno = ino_to_cg(&sblock, ino);
+	blk = (ino % sblock.fs_ipg) / INOPB(&sblock);
+	if (inocache == NULL &&
+	    (inocache = calloc(sblock.fs_ncg, sizeof(*inocache))) == NULL)
+		errx(42, "calloc failed");
+	if (inocache[cylno] == NULL && (inocache[cylno] = calloc(
+	    sblock.fs_ipg / INOPB(&sblock), sizeof(**inocache))) == NULL)
+		errx(42, "calloc failed");
+	if ((bp = inocache[cylno][blk]) != NULL)
+		return (bp);
+	if ((bp = mapaddr((part_ofs + fsbtodb(&sblock, ino_to_fsba(&sblock,
+	    ino))) * sectorsize, sblock.fs_bsize)) == NULL)
+		bp = arenaalloc(&fmtarena, sblock.fs_bsize);
+	cgp = cgget(cylno);
+	if (sblock.fs_magic == FS_UFS2_MAGIC &&
+	    (uint)blk * INOPB(&sblock) >= cgp->cg_initediblk) {
+		memset(bp, 0, sblock.fs_bsize);
+		inoblkbuild(bp, (ino_t)cylno * sblock.fs_ipg +
+		    blk * INOPB(&sblock), INOPB(&sblock));
+		cgp->cg_initediblk = (blk + 1) * INOPB(&sblock);
+	} else if (d_map == NULL && bread(part_ofs + fsbtodb(&sblock,
+	    ino_to_fsba(&sblock, ino)), bp, sblock.fs_bsize) == -1)
+		errx(31, "inode %ju: %s", (uintmax_t)ino, d_err);
+	inocache[cylno][blk] = bp;
+	return (bp);
+}
+
+/*
+ * Update the check-hashes of the "count" inodes of an inode block that
+ * are in use, computing them several at a time with
+ * calculate_crc32c_lanes() once the block is complete rather than one
+ * by one as each inode is put.
+ */
+static void
+ffs_update_dinode_ckhashes(struct fs *fs, char *bp, int count)
+{
+	const unsigned char *bufs[MAXBSIZE / sizeof(struct ufs2_dinode)];
+	uint32_t crcs[MAXBSIZE / sizeof(struct ufs2_dinode)];
+	struct ufs2_dinode *dp2;
+	int i, n;
+
+	if (fs->fs_magic != FS_UFS2_MAGIC || (fs->fs_metackhash & CK_INODE) == 0)
+		return;
+	dp2 = (struct ufs2_dinode *)bp;
+	for (i = n = 0; i < count; i++) {
+		if (dp2[i].di_mode == 0)
+			continue;
+		/*
+		 * Exclude old di_ckhash from the crc32 calculation, e.g.,
+		 * always use a check-hash value of zero when calculating
+		 * the new check-hash.
+		 */
+		dp2[i].di_ckhash = 0;
+		bufs[n++] = (const unsigned char *)&dp2[i];
+	}
+	if (n == 0)
+		return;
+	calculate_crc32c_lanes(crcs, bufs, n, sizeof(*dp2));
+	for (i = 0; i < n; i++)
+		((struct ufs2_dinode *)bufs[i])->di_ckhash = crcs[i];
+}
+
+/*
+ * Write back the cached inode blocks, joining adjacent blocks into
+ * writes of up to MAXPHYS. Blocks in a mapped image are already there.
+ */
+static void
+inoflush(void)
+{
+	char *chunk;
+	int cylno, blk, nblk, n;
+
+	if (inocache == NULL)
+		return;
+	nblk = sblock.fs_ipg / INOPB(&sblock);
+	for (cylno = 0; cylno < (int)sblock.fs_ncg; cylno++)
+		for (blk = 0; inocache[cylno] != NULL && blk < nblk; blk++)
+			if (inocache[cylno][blk] != NULL)
+				ffs_update_dinode_ckhashes(&sblock,
+				    inocache[cylno][blk], INOPB(&sblock));
+	if (d_map != NULL) {
+		for (cylno = 0; cylno < (int)sblock.fs_ncg; cylno++)
+			free(inocache[cylno]);
+		free(inocache);
+		inocache = NULL;
+		return;
 	}
-	if (acg.cg_cs.cs_nbfree == 0) {
-		printf("first cylinder group ran out of space\n");
-		exit(39);
+	if ((chunk = malloc(MAXPHYS)) == NULL)
+		errx(42, "malloc failed");
+	for (cylno = 0; cylno < (int)sblock.fs_ncg; cylno++) {
+		if (inocache[cylno] == NULL)
+			continue;
+		for (blk = 0; blk < nblk; blk += n) {
+			for (n = 0; blk + n < nblk && inocache[cylno][blk + n] !=
+			    NULL && (n + 1) * sblock.fs_bsize <= MAXPHYS; n++) {
+				memcpy(&chunk[n * sblock.fs_bsize],
+				    inocache[cylno][blk + n], sblock.fs_bsize);
+				arenafree(&fmtarena,
+				    inocache[cylno][blk + n]);
+			}
+			if (n == 0) {
+				n = 1;
+				continue;
+			}
+			wtfs(fsbtodb(&sblock, cgimin(&sblock, cylno) +
+			    blkstofrags(&sblock, blk)), n * sblock.fs_bsize,
+			    chunk);
+		}
+		free(inocache[cylno]);
 	}
-	for (d = 0; d < acg.cg_ndblk; d += sblock.fs_frag)
-		if (isblock(&sblock, cg_blksfree(&acg), d / sblock.fs_frag))
-			goto goth;
-	printf("internal error: can't find block in cyl 0\n");
-	exit(40);
-goth:
-	blkno = fragstoblks(&sblock, d);
-	clrblock(&sblock, cg_blksfree(&acg), blkno);
-	if (sblock.fs_contigsumsize > 0)
-		clrbit(cg_clustersfree(&acg), blkno);
-	acg.cg_cs.cs_nbfree--;
-	sblock.fs_cstotal.cs_nbfree--;
-	fscs[0].cs_nbfree--;
-	if (mode & IFDIR) {
-		acg.cg_cs.cs_ndir++;
+	free(inocache);
+	inocache = NULL;
+	free(chunk);
+}
+
+/*
+ * Mark an inode as allocated in its cylinder group map and in the
+ * summaries. Like the kernel, count runs of directories placed in a
+ * cylinder group in fs_contigdirs for dirpref().
+ */
+static void
+ialloced(ino_t ino, int mode)
+{
+	struct cg *cgp;
+	int cylno;
+
+	cylno = ino_to_cg(&sblock, ino);
+	cgp = cgget(cylno);
+	setbit(cg_inosused(cgp), ino % sblock.fs_ipg);
+	cgp->cg_cs.cs_nifree--;
+	fscs[cylno].cs_nifree--;
+	sblock.fs_cstotal.cs_nifree--;
+	if ((mode & IFMT) == IFDIR) {
+		cgp->cg_cs.cs_ndir++;
+		fscs[cylno].cs_ndir++;
 		sblock.fs_cstotal.cs_ndir++;
-		fscs[0].cs_ndir++;
+		if (sblock.fs_contigdirs[cylno] < 255)
+			sblock.fs_contigdirs[cylno]++;
+	} else if (sblock.fs_contigdirs[cylno] > 0)
+		sblock.fs_contigdirs[cylno]--;
+}
+
+/*
+ * Allocate the lowest free inode of a cylinder group, moving on to the
+ * following groups if it has none left.
+ */
+static ino_t
+ialloc(int cylno, int mode)
+{
+	struct cg *cgp;
+	uint i, n;
+
+	for (n = 0; n < sblock.fs_ncg; n++) {
+		if (fscs[cylno].cs_nifree > 0) {
+			cgp = cgget(cylno);
+			for (i = cgp->cg_irotor; isset(cg_inosused(cgp), i); )
+				if (++i == sblock.fs_ipg)
+					i = 0;
+			cgp->cg_irotor = i;
+			ialloced((ino_t)cylno * sblock.fs_ipg + i, mode);
+			return ((ino_t)cylno * sblock.fs_ipg + i);
+		}
+		if (++cylno == (int)sblock.fs_ncg)
+			cylno = 0;
 	}
-	if (size != sblock.fs_bsize) {
-		frag = howmany(size, sblock.fs_fsize);
-		fscs[0].cs_nffree += sblock.fs_frag - frag;
-		sblock.fs_cstotal.cs_nffree += sblock.fs_frag - frag;
-		acg.cg_cs.cs_nffree += sblock.fs_frag - frag;
-		acg.cg_frsum[sblock.fs_frag - frag]++;
-		for (i = frag; i < sblock.fs_frag; i++)
-			setbit(cg_blksfree(&acg), d + i);
+	errx(47, "out of inodes");
+}
+
+/*
+ * Allocate "frags" fragments in a cylinder group, or a whole block if
+ * "frags" is fs_frag, moving on to the following groups if it is full.
+ * As in the kernel, a free run of fragments of the smallest suitable
+ * size is used before a whole block is broken up.
+ */
+static ufs2_daddr_t
+alloc1(int cylno, int frags)
+{
+	struct cg *cgp;
+	int allocsiz, blk, nblks, i, j, run, n, bno;
+
+	for (n = 0; n < (int)sblock.fs_ncg; n++) {
+		cgp = cgget(cylno);
+		nblks = howmany(cgp->cg_ndblk, sblock.fs_frag);
+		for (allocsiz = frags; allocsiz < sblock.fs_frag; allocsiz++)
+			if (cgp->cg_frsum[allocsiz] != 0)
+				break;
+		if (allocsiz < sblock.fs_frag) {
+			blk = fragstoblks(&sblock, cgp->cg_frotor);
+			for (i = 0; i < nblks; i++, blk = (blk + 1) % nblks) {
+				if (isblock(&sblock, cg_blksfree(cgp), blk))
+					continue;
+				for (j = 0, run = 0; j <= sblock.fs_frag; j++) {
+					bno = blkstofrags(&sblock, blk) + j;
+					if (j < sblock.fs_frag && bno <
+					    (int)cgp->cg_ndblk &&
+					    isset(cg_blksfree(cgp), bno)) {
+						run++;
+						continue;
+					}
+					if (run == allocsiz)
+						goto gotfrags;
+					run = 0;
+				}
+			}
+			printf("cg %d: fragment summary is wrong\n", cylno);
+			exit(40);
+gotfrags:
+			bno -= allocsiz;
+			for (i = 0; i < frags; i++)
+				clrbit(cg_blksfree(cgp), bno + i);
+			cgp->cg_frsum[allocsiz]--;
+			if (allocsiz != frags)
+				cgp->cg_frsum[allocsiz - frags]++;
+			cgp->cg_cs.cs_nffree -= frags;
+			fscs[cylno].cs_nffree -= frags;
+			sblock.fs_cstotal.cs_nffree -= frags;
+			cgp->cg_frotor = bno;
+			return (cgbase(&sblock, cylno) + bno);
+		}
+		if (cgp->cg_cs.cs_nbfree > 0) {
+			blk = fragstoblks(&sblock, cgp->cg_rotor);
+			for (i = 0; i < nblks; i++, blk = (blk + 1) % nblks)
+				if (isblock(&sblock, cg_blksfree(cgp), blk))
+					break;
+			if (i == nblks) {
+				printf("cg %d: block summary is wrong\n", cylno);
+				exit(40);
+			}
+			clrblock(&sblock, cg_blksfree(cgp), blk);
+			if (sblock.fs_contigsumsize > 0)
+				clrbit(cg_clustersfree(cgp), blk);
+			cgp->cg_cs.cs_nbfree--;
+			fscs[cylno].cs_nbfree--;
+			sblock.fs_cstotal.cs_nbfree--;
+			bno = blkstofrags(&sblock, blk);
+			cgp->cg_rotor = bno;
+			if (frags < sblock.fs_frag) {
+				for (i = frags; i < sblock.fs_frag; i++)
+					setbit(cg_blksfree(cgp), bno + i);
+				i = sblock.fs_frag - frags;
+				cgp->cg_frsum[i]++;
+				cgp->cg_cs.cs_nffree += i;
+				fscs[cylno].cs_nffree += i;
+				sblock.fs_cstotal.cs_nffree += i;
+				cgp->cg_frotor = bno;
+			}
+			return (cgbase(&sblock, cylno) + bno);
+		}
+		if (++cylno == (int)sblock.fs_ncg)
+			cylno = 0;
 	}
-	if (cgwrite() != 0)
-		err(1, "alloc: cgwrite: %s", d_err);
-	return ((ufs2_daddr_t)d);
+	printf("file system full\n");
+	exit(39);
+}
+
+static ufs2_daddr_t
+alloc(int cylno, int frags)
+{
+	ufs2_daddr_t bno;
+	uint64_t start;
+
+	start = tracestart();
+	bno = alloc1(cylno, frags);
+	trace("alloc", start, "cg", cylno, "frags", frags);
+	return (bno);
 }
 
+
+
+
 /*
- * Update an inode check-hash.
+ * Put an inode into its cached inode block.
  */
 void
-ffs_update_dinode_ckhash(struct fs *fs, struct ufs2_dinode *dip)
+iput(union dinode *ip, ino_t ino)
 {
+	uint64_t start;
+	char *bp;
 
-	if (dip->di_mode == 0 || (fs->fs_metackhash & CK_INODE) == 0)
-		return;
+	start = tracestart();
+	bp = inoblk(ino);
+	if (sblock.fs_magic == FS_UFS1_MAGIC)
+		((struct ufs1_dinode *)bp)[ino_to_fsbo(&sblock, ino)] =
+		    ip->dp1;
+	else
+		((struct ufs2_dinode *)bp)[ino_to_fsbo(&sblock, ino)] =
+		    ip->dp2;
+	trace("iput", start, "ino", ino, NULL, 0);
+}
+
+
+/*
+ * construct a set of directory entries in "dirbuf", packed into
+ * DIRBLKSIZ chunks with the last entry of each chunk taking up the
+ * space left in it.
+ * return size of directory.
+ */
+static char *dirbuf;
+static int dirbufsize;
+
+int
+makedir(struct direct *protodir, int entries)
+{
+	struct direct *last;
+	int i, size, reclen, spcleft;
+
+	size = 0;
+	spcleft = 0;
+	last = NULL;
+	for (i = 0; i < entries; i++) {
+		reclen = DIRSIZ(0, &protodir[i]);
+		if (reclen > spcleft) {
+			if (last != NULL)
+				last->d_reclen += spcleft;
+			if (size + DIRBLKSIZ > dirbufsize) {
+				dirbufsize = MAX(2 * dirbufsize,
+				    sblock.fs_bsize);
+				if ((dirbuf = realloc(dirbuf, dirbufsize)) ==
+				    NULL)
+					errx(42, "realloc failed");
+			}
+			memset(&dirbuf[size], 0, DIRBLKSIZ);
+			size += DIRBLKSIZ;
+			spcleft = DIRBLKSIZ;
+		}
+		last = (struct direct *)&dirbuf[size - spcleft];
+		memmove(last, &protodir[i], reclen);
+		last->d_reclen = reclen;
+		spcleft -= reclen;
+	}
+	last->d_reclen += spcleft;
 	/*
-	 * Exclude old di_ckhash from the crc32 calculation, e.g., always use
-	 * a check-hash value of zero when calculating the new check-hash.
+	 * The directory is written in whole fragments; clear the rest of
+	 * the last one, which dirbuf always has room for.
 	 */
-	dip->di_ckhash = 0;
-	dip->di_ckhash = calculate_crc32c(~0L, (void *)dip, sizeof(*dip));
+	memset(&dirbuf[size], 0, fragroundup(&sblock, size) - size);
+	return (size);
 }
 
+static void
+dirent(struct direct *dp, ino_t ino, int type, const char *name)
+{
+
+	dp->d_ino = ino;
+	dp->d_type = type;
+	dp->d_namlen = strlen(name);
+	strcpy(dp->d_name, name);
+}
 
 /*
- * Allocate an inode on the disk
+ * Allocate blocks in a cylinder group for the directory in "dirbuf",
+ * write it out and enter them in its inode.
  */
-void
-iput(union dinode *ip, ino_t ino)
+static void
+wrdir(union dinode *dp, const char *name, int size, int cylno)
 {
+	ufs2_daddr_t bno;
+	int lbn, len;
 
-	bread(part_ofs + fsbtodb(&sblock, cgtod(&sblock, 0)), (char *)&acg,
-	    sblock.fs_cgsize);
-	if (acg.cg_magic != CG_MAGIC) {
-		printf("cg 0: bad magic number\n");
-		exit(31);
+	if (size > UFS_NDADDR * sblock.fs_bsize)
+		errx(44, "%s: too many entries for a directory", name);
+	for (lbn = 0; lbn * sblock.fs_bsize < size; lbn++) {
+		len = fragroundup(&sblock, MIN(size - lbn * sblock.fs_bsize,
+		    sblock.fs_bsize));
+		bno = alloc(cylno, numfrags(&sblock, len));
+		wtfs(fsbtodb(&sblock, bno), len, &dirbuf[lbn * sblock.fs_bsize]);
+		DIP_SET(dp, di_db[lbn], bno);
 	}
-	acg.cg_cs.cs_nifree--;
-	setbit(cg_inosused(&acg), ino);
-	if (cgwrite() != 0)
-		err(1, "iput: cgwrite: %s", d_err);
-	sblock.fs_cstotal.cs_nifree--;
-	fscs[0].cs_nifree--;
+	DIP_SET(dp, di_size, size);
+	DIP_SET(dp, di_blocks, fragroundup(&sblock, size) / DEV_BSIZE);
+}
 
+/*
+ * Choose a cylinder group for a new directory the way ffs_dirpref()
+ * does. Directories in the root are spread over the groups with the
+ * fewest directories. Deeper ones stay with their parent until
+ * fs_contigdirs shows that too many have been put there in a row, so
+ * that each level of a large tree is spread over several groups.
+ * The search starts at the first group rather than a random one to
+ * keep the layout reproducible.
+ */
+static int
+dirpref(struct fsnode *parent)
+{
+	int64_t avgifree, avgbfree, avgndir, minifree, minbfree;
+	int64_t cgsize, dirsize, curdirsize;
+	int cg, n, prefcg, mincg, minndir, maxndir, maxcontigdirs;
 
-	if (d_ufs == 2)
-		ffs_update_dinode_ckhash(&sblock, &ip->dp2);
+	avgifree = sblock.fs_cstotal.cs_nifree / sblock.fs_ncg;
+	avgbfree = sblock.fs_cstotal.cs_nbfree / sblock.fs_ncg;
+	avgndir = sblock.fs_cstotal.cs_ndir / sblock.fs_ncg;
+	if (parent == &fsroot) {
+		mincg = 0;
+		minndir = sblock.fs_ipg;
+		for (cg = 0; cg < (int)sblock.fs_ncg; cg++)
+			if (fscs[cg].cs_ndir < minndir &&
+			    fscs[cg].cs_nifree >= avgifree &&
+			    fscs[cg].cs_nbfree >= avgbfree) {
+				mincg = cg;
+				minndir = fscs[cg].cs_ndir;
+			}
+		return (mincg);
+	}
+	maxndir = MIN(avgndir + sblock.fs_ipg / 16, sblock.fs_ipg);
+	minifree = MAX(avgifree - avgifree / 4, 1);
+	minbfree = MAX(avgbfree - avgbfree / 4, 1);
+	cgsize = (int64_t)sblock.fs_fsize * sblock.fs_fpg;
+	dirsize = (int64_t)sblock.fs_avgfilesize * sblock.fs_avgfpdir;
+	curdirsize = avgndir ?
+	    (cgsize - avgbfree * sblock.fs_bsize) / avgndir : 0;
+	if (dirsize < curdirsize)
+		dirsize = curdirsize;
+	if (dirsize <= 0)
+		maxcontigdirs = 0;
+	else
+		maxcontigdirs = MIN((avgbfree * sblock.fs_bsize) / dirsize, 255);
+	if (sblock.fs_avgfpdir > 0)
+		maxcontigdirs = MIN(maxcontigdirs,
+		    (int)(sblock.fs_ipg / sblock.fs_avgfpdir));
+	if (maxcontigdirs == 0)
+		maxcontigdirs = 1;
+	prefcg = ino_to_cg(&sblock, parent->fn_ino);
+	for (n = 0, cg = prefcg; n < (int)sblock.fs_ncg; n++) {
+		if (fscs[cg].cs_ndir < maxndir &&
+		    fscs[cg].cs_nifree >= minifree &&
+		    fscs[cg].cs_nbfree >= minbfree &&
+		    sblock.fs_contigdirs[cg] < maxcontigdirs)
+			return (cg);
+		if (++cg == (int)sblock.fs_ncg)
+			cg = 0;
+	}
+	for (n = 0, cg = prefcg; n < (int)sblock.fs_ncg; n++) {
+		if (fscs[cg].cs_nifree >= avgifree)
+			return (cg);
+		if (++cg == (int)sblock.fs_ncg)
+			cg = 0;
+	}
+	return (prefcg);
+}
 
+/*
+ * Claim a run of free blocks of up to "want" blocks in a cylinder group
+ * for a preallocated file. The longest free run is used unless one that
+ * is long enough for the whole request is found first. The address of
+ * the run is returned in "bnop". Return the number of blocks claimed.
+ */
+static long
+allocrun(int cylno, long want, ufs2_daddr_t *bnop)
+{
+	struct cg *cgp;
+	long blkno, first, run, bestfirst, bestrun, nblks;
 
-	void *inoblock = malloc(sblock.fs_bsize);;
-	bread(fsbtodb(&sblock, ino_to_fsba(&sblock, ino)), inoblock,
-	    sblock.fs_bsize);
+	cgp = cgget(cylno);
+	nblks = fragstoblks(&sblock, cgp->cg_ndblk);
+	first = howmany(dtogd(&sblock, cgdata(&sblock, cylno)), sblock.fs_frag);
+	bestfirst = bestrun = run = 0;
+	for (blkno = first; blkno < nblks && bestrun < want; blkno++) {
+		if (!isblock(&sblock, cg_blksfree(cgp), blkno)) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			first = blkno;
+		if (run > bestrun) {
+			bestfirst = first;
+			bestrun = run;
+		}
+	}
+	if (bestrun > want)
+		bestrun = want;
+	for (blkno = bestfirst; blkno < bestfirst + bestrun; blkno++) {
+		clrblock(&sblock, cg_blksfree(cgp), blkno);
+		if (sblock.fs_contigsumsize > 0)
+			clrbit(cg_clustersfree(cgp), blkno);
+	}
+	cgp->cg_cs.cs_nbfree -= bestrun;
+	sblock.fs_cstotal.cs_nbfree -= bestrun;
+	fscs[cylno].cs_nbfree -= bestrun;
+	*bnop = cgbase(&sblock, cylno) + blkstofrags(&sblock, bestfirst);
+	return (bestrun);
+}
 
-	if (sblock.fs_magic == FS_UFS1_MAGIC)
-		((struct ufs1_dinode *)inoblock)[ino] = ip->dp1;
-	else
-		((struct ufs2_dinode *)inoblock)[ino] = ip->dp2;
+/*
+ * The runs of blocks claimed for the preallocated file being built,
+ * handed out in order by nextblk(), and its indirect blocks.
+ */
+static struct parun {
+	ufs2_daddr_t	pr_bno;		/* first fragment of run */
+	long		pr_nblks;	/* number of blocks in run */
+} *paruns;
+static int curparun, nparuns;
+static long parunused;
+static struct paindir {
+	ufs2_daddr_t	pi_bno;		/* fragment of indirect block */
+	char		*pi_buf;	/* contents of indirect block */
+} *paindirs;
+static long npaindirs;
 
+static ufs2_daddr_t
+nextblk(void)
+{
 
-	if (bwrite(fsbtodb(&sblock, ino_to_fsba(&sblock, 0)),
-	    inoblock, sblock.fs_bsize) <= 0)
-		err(1, "iput: bwrite");
+	while (parunused == paruns[curparun].pr_nblks) {
+		curparun++;
+		parunused = 0;
+	}
+	return (paruns[curparun].pr_bno + blkstofrags(&sblock, parunused++));
 }
 
+/*
+ * Build an indirect block of the given level mapping the next "*left"
+ * data blocks of the file. The indirect block precedes the blocks it
+ * maps, just as the kernel would lay them out. It is kept in memory
+ * until the whole tree has been built.
+ */
+static ufs2_daddr_t
+mkindir(int level, long *left)
+{
+	ufs2_daddr_t bno, nb;
+	char *buf;
+	int i;
+
+	bno = nextblk();
+	if ((buf = calloc(1, sblock.fs_bsize)) == NULL)
+		errx(42, "calloc failed");
+	paindirs[npaindirs].pi_bno = bno;
+	paindirs[npaindirs++].pi_buf = buf;
+	for (i = 0; i < NINDIR(&sblock) && *left > 0; i++) {
+		if (level == 0) {
+			nb = nextblk();
+			(*left)--;
+		} else
+			nb = mkindir(level - 1, left);
+		if (sblock.fs_magic == FS_UFS1_MAGIC)
+			((ufs1_daddr_t *)buf)[i] = nb;
+		else
+			((ufs2_daddr_t *)buf)[i] = nb;
+	}
+	return (bno);
+}
 
 /*
- * construct a set of directory entries in "iobuf".
- * return size of directory.
+ * Write out the claimed runs in MAXPHYS sized chunks, zero filled
+ * apart from the indirect blocks. Blocks are handed out in the order
+ * of the runs, so the indirect blocks are found in the order they are
+ * needed.
  */
-int
-makedir(struct direct *protodir, int entries)
+static void
+clearruns(void)
 {
-	char *cp;
-	int i, spcleft;
-
-	spcleft = DIRBLKSIZ;
-	memset(iobuf, 0, DIRBLKSIZ);
-	for (cp = iobuf, i = 0; i < entries - 1; i++) {
-		protodir[i].d_reclen = DIRSIZ(0, &protodir[i]);
-		memmove(cp, &protodir[i], protodir[i].d_reclen);
-		cp += protodir[i].d_reclen;
-		spcleft -= protodir[i].d_reclen;
+	ufs2_daddr_t bno, end;
+	char *chunk;
+	long n, pi;
+	int r, size;
+
+	if ((chunk = malloc(MAXPHYS)) == NULL)
+		errx(42, "malloc failed");
+	for (pi = 0, r = 0; r < nparuns; r++) {
+		end = paruns[r].pr_bno + blkstofrags(&sblock, paruns[r].pr_nblks);
+		for (bno = paruns[r].pr_bno; bno < end; bno += numfrags(&sblock,
+		    size)) {
+			n = MIN(end - bno, numfrags(&sblock, MAXPHYS));
+			size = lfragtosize(&sblock, n);
+			memset(chunk, 0, size);
+			for (; pi < npaindirs && paindirs[pi].pi_bno >= bno &&
+			    paindirs[pi].pi_bno < bno + n; pi++)
+				memcpy(&chunk[lfragtosize(&sblock,
+				    paindirs[pi].pi_bno - bno)],
+				    paindirs[pi].pi_buf, sblock.fs_bsize);
+			wtfs(fsbtodb(&sblock, bno), size, chunk);
+		}
 	}
-	protodir[i].d_reclen = spcleft;
-	memmove(cp, &protodir[i], DIRSIZ(0, &protodir[i]));
-	return (DIRBLKSIZ);
+	free(chunk);
 }
 
-void
-fsinit(time_t utime)
+/*
+ * The number of blocks a preallocated file of "size" bytes takes,
+ * counting the indirect blocks, of which there are "*nindirp".
+ */
+static long
+pablocks(off_t size, long *nindirp)
+{
+	long nblks, nindir, left, span;
+	int i, level;
+
+	nblks = howmany(size, sblock.fs_bsize);
+	nindir = 0;
+	left = nblks - UFS_NDADDR;
+	for (level = 0, span = 1; level < UFS_NIADDR && left > 0; level++) {
+		span *= NINDIR(&sblock);
+		for (i = level + 1; i > 0; i--)
+			nindir += howmany(MIN(left, span),
+			    lbn_offset(&sblock, i));
+		left -= span;
+	}
+	*nindirp = nindir;
+	return (nblks + nindir);
+}
+
+/*
+ * Create a file whose blocks are allocated contiguously as far as the
+ * cylinder group layout permits. Unless the file is to be cleared, only
+ * the block maps and the indirect blocks are written; the contents of
+ * the file are left as found.
+ */
+static void
+mkprealloc(struct prealloc *pa, ino_t ino, time_t utime)
 {
 	union dinode node;
-	struct group *grp;
-	gid_t gid;
-	int entries;
+	ufs2_daddr_t db[UFS_NDADDR], ib[UFS_NIADDR];
+	long nblks, nindir, left, want, got;
+	int cylno, i, n, level;
 
-	memset(&node, 0, sizeof node);
-	if ((grp = getgrnam("operator")) != NULL) {
-		gid = grp->gr_gid;
-	} else {
-		warnx("Cannot retrieve operator gid, using gid 0.");
-		gid = 0;
+	nblks = howmany(pa->pa_size, sblock.fs_bsize);
+	want = pablocks(pa->pa_size, &nindir);
+
+	/*
+	 * Start in the first cylinder group from that of the inode on
+	 * that can hold the whole file, otherwise spread it over as few
+	 * groups as possible.
+	 */
+	cylno = ino_to_cg(&sblock, ino);
+	for (n = 0; n < (int)sblock.fs_ncg; n++) {
+		if (fscs[cylno].cs_nbfree >= want)
+			break;
+		if (++cylno == (int)sblock.fs_ncg)
+			cylno = 0;
+	}
+	if ((paruns = calloc(sblock.fs_ncg, sizeof(*paruns))) == NULL ||
+	    (paindirs = calloc(nindir + 1, sizeof(*paindirs))) == NULL)
+		errx(42, "calloc failed");
+	curparun = nparuns = parunused = npaindirs = 0;
+	for (left = want, n = 0; left > 0; n++) {
+		if (n == (int)sblock.fs_ncg)
+			errx(43, "%s: not enough space to preallocate %jd bytes",
+			    pa->pa_name, (intmax_t)pa->pa_size);
+		got = allocrun(cylno, left, &paruns[nparuns].pr_bno);
+		if (++cylno == (int)sblock.fs_ncg)
+			cylno = 0;
+		if (got == 0)
+			continue;
+		paruns[nparuns++].pr_nblks = got;
+		left -= got;
+	}
+
+	memset(db, 0, sizeof(db));
+	memset(ib, 0, sizeof(ib));
+	for (i = 0; i < UFS_NDADDR && i < nblks; i++)
+		db[i] = nextblk();
+	left = nblks - UFS_NDADDR;
+	for (level = 0; level < UFS_NIADDR && left > 0; level++)
+		ib[level] = mkindir(level, &left);
+	if (pa->pa_clear)
+		clearruns();
+	for (i = 0; i < npaindirs; i++) {
+		if (!pa->pa_clear)
+			wtfs(fsbtodb(&sblock, paindirs[i].pi_bno),
+			    sblock.fs_bsize, paindirs[i].pi_buf);
+		free(paindirs[i].pi_buf);
 	}
-	entries = (nflag) ? ROOTLINKCNT - 1: ROOTLINKCNT;
+	free(paindirs);
+	free(paruns);
+
+	memset(&node, 0, sizeof(node));
 	if (sblock.fs_magic == FS_UFS1_MAGIC) {
-		/*
-		 * initialize the node
-		 */
 		node.dp1.di_atime = utime;
 		node.dp1.di_mtime = utime;
 		node.dp1.di_ctime = utime;
-		/*
-		 * create the root directory
-		 */
-		node.dp1.di_mode = IFDIR | UMASK;
-		node.dp1.di_nlink = entries;
-		node.dp1.di_size = makedir(root_dir, entries);
-		node.dp1.di_db[0] = alloc(sblock.fs_fsize, node.dp1.di_mode);
-		node.dp1.di_blocks =
-		    fragroundup(&sblock, node.dp1.di_size)/sectorsize;
-		wtfs(fsbtodb(&sblock, node.dp1.di_db[0]), sblock.fs_fsize,
-		    iobuf);
-		iput(&node, UFS_ROOTINO);
-		if (!nflag) {
-			/*
-			 * create the .snap directory
-			 */
-			node.dp1.di_mode |= 020;
-			node.dp1.di_gid = gid;
-			node.dp1.di_nlink = SNAPLINKCNT;
-			node.dp1.di_size = makedir(snap_dir, SNAPLINKCNT);
-				node.dp1.di_db[0] =
-				    alloc(sblock.fs_fsize, node.dp1.di_mode);
-			node.dp1.di_blocks =
-			    fragroundup(&sblock, node.dp1.di_size)/sectorsize;
-			node.dp1.di_dirdepth = 1;
-			wtfs(fsbtodb(&sblock, node.dp1.di_db[0]),
-				    sblock.fs_fsize, iobuf);
-			iput(&node, UFS_ROOTINO + 1);
-		}
+		node.dp1.di_mode = IFREG | pa->pa_mode;
+		node.dp1.di_nlink = 1;
+		node.dp1.di_flags = pa->pa_flags;
+		node.dp1.di_size = pa->pa_size;
+		node.dp1.di_blocks = want * (sblock.fs_bsize / DEV_BSIZE);
+		for (i = 0; i < UFS_NDADDR; i++)
+			node.dp1.di_db[i] = db[i];
+		for (i = 0; i < UFS_NIADDR; i++)
+			node.dp1.di_ib[i] = ib[i];
 	} else {
-		/*
-		 * initialize the node
-		 */
 		node.dp2.di_atime = utime;
 		node.dp2.di_mtime = utime;
 		node.dp2.di_ctime = utime;
 		node.dp2.di_birthtime = utime;
+		node.dp2.di_mode = IFREG | pa->pa_mode;
+		node.dp2.di_nlink = 1;
+		node.dp2.di_flags = pa->pa_flags;
+		node.dp2.di_size = pa->pa_size;
+		node.dp2.di_blocks = want * (sblock.fs_bsize / DEV_BSIZE);
+		for (i = 0; i < UFS_NDADDR; i++)
+			node.dp2.di_db[i] = db[i];
+		for (i = 0; i < UFS_NIADDR; i++)
+			node.dp2.di_ib[i] = ib[i];
+	}
+	iput(&node, ino);
+	printf("preallocated /%s: %jd bytes in %d extent%s\n", pa->pa_name,
+	    (intmax_t)pa->pa_size, nparuns, nparuns == 1 ? "" : "s");
+}
+
+
+
+/*
+ * Create a directory and everything below it. Inodes for the entries
+ * are allocated first, subdirectories in the cylinder groups chosen by
+ * dirpref() and files next to their directory, so that the directory
+ * can be written out before its entries are created.
+ */
+static void
+mkdirs(struct fsnode *dir, int depth, time_t utime)
+{
+	union dinode node;
+	struct direct *dirp;
+	struct fsnode *np;
+	int entries, i, n;
+
+	for (i = 0; i < dir->fn_nchild; i++) {
+		np = dir->fn_child[i];
+		if (np->fn_type == DT_DIR)
+			np->fn_ino = ialloc(dirpref(dir), IFDIR);
+		else
+			np->fn_ino = ialloc(ino_to_cg(&sblock, dir->fn_ino),
+			    IFREG);
+	}
+	if ((dirp = calloc(dir->fn_nchild + 3, sizeof(*dirp))) == NULL)
+		errx(42, "calloc failed");
+	entries = 0;
+	dirent(&dirp[entries++], dir->fn_ino, DT_DIR, ".");
+	dirent(&dirp[entries++], dir->fn_parent->fn_ino, DT_DIR, "..");
+	if (dir == &fsroot && !nflag)
+		dirent(&dirp[entries++], UFS_ROOTINO + 1, DT_DIR, ".snap");
+	for (i = 0; i < dir->fn_nchild; i++) {
+		np = dir->fn_child[i];
+		dirent(&dirp[entries++], np->fn_ino, np->fn_type, np->fn_name);
+	}
+	n = makedir(dirp, entries);
+	free(dirp);
+
+	memset(&node, 0, sizeof(node));
+	DIP_SET(&node, di_atime, utime);
+	DIP_SET(&node, di_mtime, utime);
+	DIP_SET(&node, di_ctime, utime);
+	if (sblock.fs_magic == FS_UFS2_MAGIC)
+		node.dp2.di_birthtime = utime;
+	DIP_SET(&node, di_mode, IFDIR | UMASK);
+	DIP_SET(&node, di_nlink, 2 + dir->fn_ndirs +
+	    (dir == &fsroot && !nflag));
+	DIP_SET(&node, di_dirdepth, depth);
+	wrdir(&node, dir->fn_name, n, ino_to_cg(&sblock, dir->fn_ino));
+	iput(&node, dir->fn_ino);
+
+	for (i = 0; i < dir->fn_nchild; i++) {
+		np = dir->fn_child[i];
+		if (np->fn_type == DT_DIR)
+			mkdirs(np, depth + 1, utime);
+		else
+			mkprealloc(np->fn_pa, np->fn_ino, utime);
+	}
+}
+
+/*
+ * Count the bytes of a directory entry with a name of "namlen" bytes
+ * into a directory being sized the way makedir() packs it.
+ */
+static void
+dirfit(int *sizep, int *spcleftp, int namlen)
+{
+	int reclen;
+
+	reclen = DIRECTSIZ(namlen);
+	if (reclen > *spcleftp) {
+		*sizep += DIRBLKSIZ;
+		*spcleftp = DIRBLKSIZ;
+	}
+	*spcleftp -= reclen;
+}
+
+/*
+ * Add up the fragments mkdirs() takes for the directories from "dir"
+ * down and the blocks it takes for the preallocated files below it.
+ * A directory with more entries than its direct blocks hold is an
+ * error here rather than in wrdir().
+ */
+static void
+treeblks(struct fsnode *dir, int64_t *dirfragsp, int64_t *pablksp)
+{
+	struct fsnode *np;
+	long nindir;
+	int i, size, spcleft;
+
+	size = spcleft = 0;
+	dirfit(&size, &spcleft, 1);
+	dirfit(&size, &spcleft, 2);
+	if (dir == &fsroot && !nflag)
+		dirfit(&size, &spcleft, 5);
+	for (i = 0; i < dir->fn_nchild; i++)
+		dirfit(&size, &spcleft, strlen(dir->fn_child[i]->fn_name));
+	if (size > UFS_NDADDR * sblock.fs_bsize)
+		errx(44, "%s: too many entries for a directory",
+		    dir == &fsroot ? "/" : dir->fn_name);
+	*dirfragsp += numfrags(&sblock, fragroundup(&sblock, size));
+	for (i = 0; i < dir->fn_nchild; i++) {
+		np = dir->fn_child[i];
+		if (np->fn_type == DT_DIR)
+			treeblks(np, dirfragsp, pablksp);
+		else
+			*pablksp += pablocks(np->fn_pa->pa_size, &nindir);
+	}
+}
+
+/*
+ * Make sure that what fsinit() makes fits, before anything is written.
+ * The directories, .snap among them, take fragments from anywhere,
+ * breaking up whole blocks once the free fragments run out, and spill
+ * into the data zones of the cylinder groups once the space held for
+ * metadata is full. The preallocated files, the journal among them,
+ * take whole blocks and only in the data zones.
+ */
+void
+fscheck(void)
+{
+	int64_t dirfrags, dirblks, pablks, datablks;
+	ufs2_daddr_t first;
+	long nblks;
+	uint cg;
+
+	dirfrags = nflag ? 0 :
+	    numfrags(&sblock, fragroundup(&sblock, DIRBLKSIZ));
+	pablks = 0;
+	treeblks(&fsroot, &dirfrags, &pablks);
+	datablks = 0;
+	for (cg = 0; cg < sblock.fs_ncg; cg++) {
+		nblks = fragstoblks(&sblock, MIN(sblock.fs_fpg,
+		    sblock.fs_size - cgbase(&sblock, cg)));
+		first = cgdata(&sblock, cg);
+		if (cg == 0)
+			first = MAX(first, sblock.fs_csaddr +
+			    howmany(sblock.fs_cssize, sblock.fs_fsize));
+		datablks += MAX(0, nblks - (long)howmany(dtogd(&sblock, first),
+		    sblock.fs_frag));
+	}
+	if (dirfrags > sblock.fs_cstotal.cs_nffree +
+	    blkstofrags(&sblock, sblock.fs_cstotal.cs_nbfree))
+		errx(46, "not enough space for directories");
+	/* Fragments are shared within a group, so each may waste a block. */
+	dirblks = howmany(MAX(0, dirfrags - sblock.fs_cstotal.cs_nffree),
+	    sblock.fs_frag);
+	dirblks += MIN(dirblks, sblock.fs_ncg);
+	if (pablks + MAX(0, dirblks - (sblock.fs_cstotal.cs_nbfree -
+	    datablks)) > datablks ||
+	    pablks + dirblks > sblock.fs_cstotal.cs_nbfree)
+		errx(46, "not enough space for preallocated files");
+}
+
+void
+fsinit(time_t utime)
+{
+	union dinode node;
+	struct group *grp;
+	gid_t gid;
+	int n;
+
+	if (deterministic) {
+		/* The gid of operator in FreeBSD's /etc/group. */
+		gid = 5;
+	} else if ((grp = getgrnam("operator")) != NULL) {
+		gid = grp->gr_gid;
+	} else {
+		warnx("Cannot retrieve operator gid, using gid 0.");
+		gid = 0;
+	}
+	if ((sblock.fs_contigdirs = calloc(sblock.fs_ncg,
+	    sizeof(*sblock.fs_contigdirs))) == NULL)
+		errx(42, "calloc failed");
+	ialloced(UFS_ROOTINO, IFDIR);
+	if (!nflag)
+		ialloced(UFS_ROOTINO + 1, IFDIR);
+	/*
+	 * create the root directory and the tree below it
+	 */
+	mkdirs(&fsroot, 0, utime);
+	if (!nflag) {
 		/*
-		 * create the root directory
+		 * create the .snap directory
 		 */
-		node.dp2.di_mode = IFDIR | UMASK;
-		node.dp2.di_nlink = entries;
-		node.dp2.di_size = makedir(root_dir, entries);
-		node.dp2.di_db[0] = alloc(sblock.fs_fsize, node.dp2.di_mode);
-		node.dp2.di_blocks =
-		    /*fsbtodb*/fragroundup(&sblock, node.dp2.di_size)/sectorsize;
-		
-		wtfs(fsbtodb(&sblock, node.dp2.di_db[0]), sblock.fs_fsize,
-		    iobuf);
-		iput(&node, UFS_ROOTINO);
-		if (!nflag) {
-			/*
-			 * create the .snap directory
-			 */
-			node.dp2.di_mode |= 020;
-			node.dp2.di_gid = gid;
-			node.dp2.di_nlink = SNAPLINKCNT;
-			node.dp2.di_size = makedir(snap_dir, SNAPLINKCNT);
-				node.dp2.di_db[0] =
-				    alloc(sblock.fs_fsize, node.dp2.di_mode);
-			node.dp2.di_blocks =
-			    fragroundup(&sblock, node.dp2.di_size)/sectorsize;
-			node.dp2.di_dirdepth = 1;
-			wtfs(fsbtodb(&sblock, node.dp2.di_db[0]), 
-				    sblock.fs_fsize, iobuf);
-			iput(&node, UFS_ROOTINO + 1);
-		}
+		memset(&node, 0, sizeof(node));
+		DIP_SET(&node, di_atime, utime);
+		DIP_SET(&node, di_mtime, utime);
+		DIP_SET(&node, di_ctime, utime);
+		if (sblock.fs_magic == FS_UFS2_MAGIC)
+			node.dp2.di_birthtime = utime;
+		DIP_SET(&node, di_mode, IFDIR | UMASK | 020);
+		DIP_SET(&node, di_gid, gid);
+		DIP_SET(&node, di_nlink, SNAPLINKCNT);
+		DIP_SET(&node, di_dirdepth, 1);
+		n = makedir(snap_dir, SNAPLINKCNT);
+		wrdir(&node, ".snap", n, 0);
+		iput(&node, UFS_ROOTINO + 1);
 	}
+	cgflush();
+	inoflush();
+	free(sblock.fs_contigdirs);
+	sblock.fs_contigdirs = NULL;
 }
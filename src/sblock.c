@@ -28,10 +28,108 @@
  */
 
 #include <inttypes.h>
+#include <pthread.h>
+#include <sys/mman.h>
 
 
+/*
+ * With --mmap an image file is mapped as a whole and written by copying
+ * into the mapping, or not at all when a structure has been built in
+ * place. Offsets are in bytes from the start of the image.
+ */
+void *
+mapaddr(off_t off, size_t size)
+{
+
+	if (d_map == NULL || off < 0 || (size_t)off + size > d_mapsize)
+		return (NULL);
+	return (d_map + off);
+}
+
+static int
+mapwrite(off_t off, const void *buf, size_t size)
+{
+	char *p;
+
+	if ((p = mapaddr(off, size)) == NULL)
+		return (-1);
+	if (p != buf)
+		memcpy(p, buf, size);
+	return (0);
+}
+
+/*
+ * Map the image. Nothing is populated here, so that memory use does
+ * not grow with the size of a sparse image.
+ */
+void
+mapimage(void)
+{
+	struct stat st;
+
+	if (fstat(d_fd, &st) == -1)
+		err(1, "%s", d_name);
+	if (!S_ISREG(st.st_mode))
+		errx(1, "%s: --mmap needs an image file", d_name);
+	d_mapsize = st.st_size;
+	d_map = mmap(NULL, d_mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    d_fd, 0);
+	if (d_map == MAP_FAILED)
+		err(1, "%s: mmap", d_name);
+}
+
+/*
+ * Fault in a window of metadata that is about to be built in place,
+ * by mapping it again with MAP_POPULATE. It is only a hint.
+ */
+void
+mappopulate(off_t off, size_t size)
+{
+	off_t start;
+	long pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	start = rounddown(off, pagesize);
+	size = MIN(roundup(off + size, pagesize), d_mapsize) - start;
+	if (mapaddr(start, size) != NULL)
+		(void)mmap(d_map + start, size, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_FIXED | MAP_POPULATE, d_fd, start);
+}
+
+/*
+ * Start writeback of a range of the image that is done with and drop
+ * it from the mapping, to keep memory use bounded.
+ */
+void
+mapflush(off_t from, off_t to)
+{
+	long pagesize;
+
+	pagesize = sysconf(_SC_PAGESIZE);
+	from = rounddown(from, pagesize);
+	to = MIN(roundup(to, pagesize), (off_t)d_mapsize);
+	if (d_map == NULL || from >= to)
+		return;
+	if (msync(d_map + from, to - from, MS_ASYNC) == -1)
+		err(1, "%s: msync", d_name);
+	(void)madvise(d_map + from, to - from, MADV_DONTNEED);
+}
+
+void
+unmapimage(void)
+{
+
+	if (d_map == NULL)
+		return;
+	if (msync(d_map, d_mapsize, MS_SYNC) == -1)
+		err(1, "%s: msync", d_name);
+	munmap(d_map, d_mapsize);
+	d_map = NULL;
+}
+
 /*
  * A write function for use by user-level programs using sbput in libufs.
+ * The location is relative to the start of the file system.
  */
 static int
 use_pwrite(void *devfd, uint64_t loc, void *buf, int size)
@@ -39,7 +137,13 @@ use_pwrite(void *devfd, uint64_t loc, void *buf, int size)
 	int fd;
 
 	fd = *(int *)devfd;
-	if (pwrite(fd, buf, size, loc) != size)
+	if (d_map != NULL)
+		return (mapwrite(loc + part_ofs * sectorsize, buf, size) == 0 ?
+		    0 : EIO);
+	if (plan.wp_open)
+		return (planadd(loc + part_ofs * sectorsize, buf, size) == 0 ?
+		    0 : EIO);
+	if (dpwrite(fd, buf, size, loc + part_ofs * sectorsize) != size)
 		return (EIO);
 	return (0);
 }
@@ -125,6 +229,28 @@ ffs_calc_sbhash(struct fs *fs)
 	return (ckhash);
 }
 
+/*
+ * Make the writes made so far durable, before one that must not reach
+ * the disk ahead of them: run the plan, then flush the mapping and the
+ * device. A sparse image is only whole once it is closed, so there is
+ * nothing to flush for one. Return 0, or an errno with d_err set.
+ */
+int
+devsync(int devfd)
+{
+
+	if (planrun() != 0)
+		return (errno);
+	if (sparse.sp_open)
+		return (0);
+	if ((d_map != NULL && msync(d_map, d_mapsize, MS_SYNC) != 0) ||
+	    fdatasync(devfd) != 0) {
+		d_err = "can't flush to block device";
+		return (errno);
+	}
+	return (0);
+}
+
 /*
  * Write a superblock to the devfd device from the memory pointed to by fs.
  * Write out the superblock summary information if it is present.
@@ -134,35 +260,30 @@ ffs_calc_sbhash(struct fs *fs)
  *     EIO: failed to write superblock.
  *     EIO: failed to write superblock summary information.
  */
-int
-ffs_sbput(void *devfd, struct fs *fs, uint64_t loc)
+static int
+ffs_sbput1(void *devfd, struct fs *fs, uint64_t loc)
 {
 
 	struct fs_summary_info *fs_si;
-	int i, error, blks, size;
-	uint8_t *space;
+	int error;
 
 	/*
 	 * If there is summary information, write it first, so if there
-	 * is an error, the superblock will not be marked as clean.
+	 * is an error, the superblock will not be marked as clean. Unlike
+	 * the kernel, which goes through the buffer cache a block at a
+	 * time, it is written in one piece, and in a plan epoch before
+	 * that of the superblock. Ahead of a valid superblock it is on
+	 * the disk before the superblock is written, along with all that
+	 * went before it.
 	 */
 	if (fs->fs_si != NULL && fs->fs_csp != NULL) {
-
-		blks = howmany(fs->fs_cssize, fs->fs_fsize);
-		space = (uint8_t *)fs->fs_csp;
-		for (i = 0; i < blks; i += fs->fs_frag) {
-
-			size = fs->fs_bsize;
-			if (i + fs->fs_frag > blks)
-				size = (blks - i) * fs->fs_fsize;
-
-			if ((error = use_pwrite(devfd,
-			     (fsbtodb(fs, fs->fs_csaddr + i))*sectorsize,
-			     space, size)) != 0)
-				return (error);
-
-			space += size;
-		}
+		if ((error = use_pwrite(devfd, fsbtodb(fs, fs->fs_csaddr) *
+		    sectorsize, fs->fs_csp, fragroundup(fs, fs->fs_cssize))) != 0)
+			return (error);
+		if (fs->fs_magic == FS_BAD_MAGIC)
+			planfence();
+		else if ((error = devsync(*(int *)devfd)) != 0)
+			return (error);
 	}
 
 	fs->fs_fmod = 0;
@@ -170,7 +291,7 @@ ffs_sbput(void *devfd, struct fs *fs, uint64_t loc)
 #ifdef _KERNEL
 	fs->fs_time = time_second;
 #else /* User Code */
-	fs->fs_time = time(NULL);
+	fs->fs_time = sbtime != 0 ? sbtime : time(NULL);
 #endif
 	/* Clear the pointers for the duration of writing. */
 	fs_si = fs->fs_si;
@@ -190,49 +311,151 @@ ffs_sbput(void *devfd, struct fs *fs, uint64_t loc)
 	return (error);
 }
 
+int
+ffs_sbput(void *devfd, struct fs *fs, uint64_t loc)
+{
+	uint64_t start;
+	int error;
+
+	start = tracestart();
+	error = ffs_sbput1(devfd, fs, loc);
+	trace("sbput", start, "offset", loc, "size", fs->fs_sbsize);
+	return (error);
+}
+
 
 
+/*
+ * The alternate superblocks are written by a fan-out of threads, each
+ * taking SBBATCH cylinder groups at a time. They share one serialized
+ * image of the superblock, which is not changed while they run; each
+ * copy differs from it only in fs_sblockactualloc and the check-hash.
+ */
+#define	SBBATCH		64
+#define	MAXSBTHREADS	16
+
+struct sbfanout {
+	int		 sf_fd;		/* device to write to */
+	const struct fs	*sf_image;	/* superblock padded to fs_sbsize */
+	uint32_t	 sf_next;	/* next cylinder group to write */
+	uint32_t	 sf_last;	/* number of alternates to write */
+	int		 sf_error;	/* first error, if any */
+};
+
+static void *
+sbfanworker(void *arg)
+{
+	struct sbfanout *sf;
+	const struct fs *fs;
+	struct fs *sbp;
+	char *buf;
+	uint32_t cylno, i, n;
+	int error;
+
+	sf = arg;
+	fs = sf->sf_image;
+	if ((buf = aligned_alloc(LIBUFS_BUFALIGN, SBBATCH * fs->fs_sbsize)) ==
+	    NULL) {
+		__atomic_store_n(&sf->sf_error, ENOMEM, __ATOMIC_RELAXED);
+		return (NULL);
+	}
+	error = 0;
+	while (error == 0 &&
+	    __atomic_load_n(&sf->sf_error, __ATOMIC_RELAXED) == 0 &&
+	    (cylno = __atomic_fetch_add(&sf->sf_next, SBBATCH,
+	    __ATOMIC_RELAXED)) < sf->sf_last) {
+		n = MIN(SBBATCH, sf->sf_last - cylno);
+		for (i = 0; i < n; i++) {
+			sbp = (struct fs *)&buf[i * fs->fs_sbsize];
+			memcpy(sbp, fs, fs->fs_sbsize);
+			sbp->fs_sblockactualloc =
+			    fsbtodb(fs, cgsblock(fs, cylno + i)) * sectorsize;
+			sbp->fs_ckhash = ffs_calc_sbhash(sbp);
+		}
+		for (i = 0; i < n && error == 0; i++) {
+			sbp = (struct fs *)&buf[i * fs->fs_sbsize];
+			error = use_pwrite(&sf->sf_fd, sbp->fs_sblockactualloc,
+			    sbp, fs->fs_sbsize);
+		}
+	}
+	if (error != 0)
+		__atomic_compare_exchange_n(&sf->sf_error, &(int){ 0 }, error,
+		    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+	free(buf);
+	return (NULL);
+}
+
 /*
  * Write a superblock to the devfd device from the memory pointed to by fs.
  * Also write out the superblock summary information but do not free the
  * summary information memory.
  *
  * Additionally write out numaltwrite of the alternate superblocks. Use
- * fs->fs_ncg to write out all of the alternate superblocks.
+ * fs->fs_ncg to write out all of the alternate superblocks. These, and
+ * everything else written before, are flushed to the disk before a
+ * valid primary superblock is written, so that a crash part way through
+ * never leaves the primary ahead of its backups.
  */
 int
 sbput(int devfd, struct fs *fs, int numaltwrite)
 {
-	struct csum *savedcsp;
-	uint64_t savedactualloc;
+	pthread_t threads[MAXSBTHREADS];
+	struct sbfanout sf;
+	struct fs *sbp;
+	long nthreads;
 	int i, error;
 
-
-	error = ffs_sbput(&devfd, fs, fs->fs_sblockactualloc);
-
-	fflush(NULL); /* flush any messages */
-	if (error != 0 || numaltwrite == 0)
-		return (error);
-	savedactualloc = fs->fs_sblockactualloc;
-	if (fs->fs_si != NULL) {
-		savedcsp = fs->fs_csp;
-		fs->fs_csp = NULL;
-	}
-	for (i = 0; i < numaltwrite; i++) {
-		fs->fs_sblockactualloc = (fsbtodb(fs, cgsblock(fs, i)))*sectorsize;
-		if ((error = ffs_sbput(&devfd, fs, fs->fs_sblockactualloc
-		     )) != 0) {
+	fs->fs_fmod = 0;
+	ffs_oldfscompat_write(fs);
+	fs->fs_time = sbtime != 0 ? sbtime : time(NULL);
+	/*
+	 * struct fs is smaller than fs_sbsize, so every copy, the primary
+	 * included, is written from a padded image.
+	 */
+	if ((sbp = aligned_alloc(LIBUFS_BUFALIGN, fs->fs_sbsize)) == NULL)
+		return (ENOMEM);
+	memset(sbp, 0, fs->fs_sbsize);
+	memcpy(sbp, fs, sizeof(*fs));
+	sbp->fs_si = NULL;
+	if (numaltwrite > 0) {
+		sf.sf_fd = devfd;
+		sf.sf_image = sbp;
+		sf.sf_next = 0;
+		sf.sf_last = numaltwrite;
+		sf.sf_error = 0;
+		nthreads = ncpus();
+		nthreads = MAX(1, MIN(nthreads,
+		    MIN(MAXSBTHREADS, howmany(numaltwrite, SBBATCH))));
+		for (i = 1; i < nthreads; i++)
+			if ((error = pthread_create(&threads[i], NULL,
+			    sbfanworker, &sf)) != 0) {
+				errno = error;
+				err(1, "pthread_create");
+			}
+		sbfanworker(&sf);
+		for (i = 1; i < nthreads; i++)
+			pthread_join(threads[i], NULL);
+		if (sf.sf_error != 0) {
+			free(sbp);
 			fflush(NULL); /* flush any messages */
-			fs->fs_sblockactualloc = savedactualloc;
-			fs->fs_csp = savedcsp;
-			return (error);
+			return (sf.sf_error);
 		}
 	}
-	fs->fs_sblockactualloc = savedactualloc;
-	if (fs->fs_si != NULL)
-		fs->fs_csp = savedcsp;
+	/* Without a summary area for ffs_sbput1() to sync after, sync here. */
+	sbp->fs_si = fs->fs_si;
+	if ((numaltwrite > 0 || fs->fs_magic != FS_BAD_MAGIC) &&
+	    (fs->fs_si == NULL || fs->fs_csp == NULL ||
+	    fs->fs_magic == FS_BAD_MAGIC) && (error = devsync(devfd)) != 0) {
+		free(sbp);
+		return (error);
+	}
+	planfence();
+	error = ffs_sbput(&devfd, sbp, fs->fs_sblockactualloc);
+	fs->fs_time = sbp->fs_time;
+	fs->fs_ckhash = sbp->fs_ckhash;
+	free(sbp);
 	fflush(NULL); /* flush any messages */
-	return (0);
+	return (error);
 }
 
 
@@ -258,14 +481,24 @@ sbwrite(int all)
 }
 
 
-ssize_t
-bwrite(ufs2_daddr_t blockno, const void *data, size_t size)
+static ssize_t
+bwrite1(ufs2_daddr_t blockno, const void *data, size_t size)
 {
 	ssize_t cnt;
 	void *p2;
 
 	d_err = NULL;
 
+	if (d_map != NULL) {
+		if (mapwrite((off_t)blockno * sectorsize, data, size) != 0) {
+			d_err = "write beyond end of image";
+			return (-1);
+		}
+		return (size);
+	}
+	if (plan.wp_open)
+		return (planadd((off_t)blockno * sectorsize, data, size) == 0 ?
+		    (ssize_t)size : -1);
 
 	BUF_MALLOC(&p2, data, size);
 	if (p2 == NULL) {
@@ -274,7 +507,7 @@ bwrite(ufs2_daddr_t blockno, const void *data, size_t size)
 	}
 	if (p2 != data)
 		memcpy(p2, data, size);
-	cnt = pwrite(d_fd, p2, size, (off_t)(blockno * sectorsize));
+	cnt = dpwrite(d_fd, p2, size, (off_t)(blockno * sectorsize));
 	if (p2 != data)
 		free(p2);
 	if (cnt == -1) {
@@ -288,34 +521,50 @@ bwrite(ufs2_daddr_t blockno, const void *data, size_t size)
 	return (cnt);
 }
 
+ssize_t
+bwrite(ufs2_daddr_t blockno, const void *data, size_t size)
+{
+	uint64_t start;
+	ssize_t cnt;
+
+	start = tracestart();
+	cnt = bwrite1(blockno, data, size);
+	trace("bwrite", start, "offset", (int64_t)blockno * sectorsize,
+	    "size", size);
+	return (cnt);
+}
+
 
 /*
  * possibly write to disk
  */
-static void
+void
 wtfs(ufs2_daddr_t bno, int size, char *bf)
 {
 	if (Nflag)
 		return;
 	if (bwrite(part_ofs + bno, bf, size) < 0)
-		err(36, "wtfs: %d bytes at sector %jd", size, (intmax_t)bno);
+		err(36, "wtfs: %d bytes at sector %jd: %s", size, (intmax_t)bno,
+		    d_err);
 }
 
 
-ssize_t
-bread(uint64_t blockno, void *data, size_t size)
+static ssize_t
+bread1(uint64_t blockno, void *data, size_t size)
 {
 	void *p2;
 	ssize_t cnt;
 
-
+	p2 = data;
+	if (plan.wp_open && planrun() != 0)
+		goto fail;
 
 	BUF_MALLOC(&p2, data, size);
 	if (p2 == NULL) {
 		d_err = "allocate bounce buffer";
 		goto fail;
 	}
-	cnt = pread(d_fd, p2, size, (off_t)(blockno * sectorsize));
+	cnt = dpread(d_fd, p2, size, (off_t)(blockno * sectorsize));
 	if (cnt == -1) {
 		d_err = "read error from block device";
 		goto fail;
@@ -339,3 +588,71 @@ fail:	memset(data, 0, size);
 	}
 	return (-1);
 }
+
+ssize_t
+bread(uint64_t blockno, void *data, size_t size)
+{
+	uint64_t start;
+	ssize_t cnt;
+
+	start = tracestart();
+	cnt = bread1(blockno, data, size);
+	trace("bread", start, "offset", (int64_t)blockno * sectorsize,
+	    "size", size);
+	return (cnt);
+}
+
+/*
+ * Read the superblock of an existing file system into sblock, trying
+ * each of the standard locations in turn, and its summary information
+ * into fscs. The sector size is taken from the superblock so that
+ * block numbers are converted the way the file system was made.
+ */
+int
+sbread(void)
+{
+	static const int sblocksearch[] = SBLOCKSEARCH;
+	struct fs *fs;
+	int i;
+
+	d_err = NULL;
+	if ((fs = aligned_alloc(LIBUFS_BUFALIGN, SBLOCKSIZE)) == NULL) {
+		d_err = "allocate superblock buffer";
+		return (-1);
+	}
+	for (i = 0; sblocksearch[i] != -1; i++) {
+		if (dpread(d_fd, fs, SBLOCKSIZE, (off_t)sblocksearch[i] +
+		    part_ofs * sectorsize) != SBLOCKSIZE)
+			continue;
+		if ((fs->fs_magic == FS_UFS1_MAGIC ||
+		    (fs->fs_magic == FS_UFS2_MAGIC &&
+		    fs->fs_sblockloc == sblocksearch[i])) &&
+		    fs->fs_ncg >= 1 && fs->fs_bsize >= MINBSIZE &&
+		    fs->fs_bsize <= MAXBSIZE && fs->fs_sbsize <= SBLOCKSIZE &&
+		    fs->fs_bsize >= (int32_t)sizeof(struct fs))
+			break;
+	}
+	if (sblocksearch[i] == -1) {
+		free(fs);
+		d_err = "no usable superblock found";
+		return (-1);
+	}
+	if ((fs->fs_metackhash & CK_SUPERBLOCK) != 0 &&
+	    ffs_calc_sbhash(fs) != fs->fs_ckhash) {
+		free(fs);
+		d_err = "superblock check-hash failed";
+		return (-1);
+	}
+	memcpy(&sblock, fs, sizeof(sblock));
+	free(fs);
+	sblock.fs_si = NULL;
+	sectorsize = sblock.fs_fsize >> sblock.fs_fsbtodb;
+	if ((fscs = malloc(fragroundup(&sblock, sblock.fs_cssize))) == NULL) {
+		d_err = "allocate summary information";
+		return (-1);
+	}
+	if (bread(part_ofs + fsbtodb(&sblock, sblock.fs_csaddr), fscs,
+	    fragroundup(&sblock, sblock.fs_cssize)) == -1)
+		return (-1);
+	return (0);
+}
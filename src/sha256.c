@@ -0,0 +1,167 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * SHA-256 as specified in FIPS 180-4, with the interface of libmd's
+ * sha256.h, which is not available everywhere this is built.
+ */
+
+#define	SHA256_BLOCK_LENGTH		64
+#define	SHA256_DIGEST_LENGTH		32
+#define	SHA256_DIGEST_STRING_LENGTH	(SHA256_DIGEST_LENGTH * 2 + 1)
+
+typedef struct SHA256Context {
+	uint32_t state[8];
+	uint64_t count;
+	uint8_t	buf[SHA256_BLOCK_LENGTH];
+} SHA256_CTX;
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define	ROTR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+#define	CH(x, y, z)	(((x) & (y)) ^ (~(x) & (z)))
+#define	MAJ(x, y, z)	(((x) & (y)) ^ ((x) & (z)) ^ ((y) & (z)))
+#define	S0(x)		(ROTR(x, 2) ^ ROTR(x, 13) ^ ROTR(x, 22))
+#define	S1(x)		(ROTR(x, 6) ^ ROTR(x, 11) ^ ROTR(x, 25))
+#define	s0(x)		(ROTR(x, 7) ^ ROTR(x, 18) ^ ((x) >> 3))
+#define	s1(x)		(ROTR(x, 17) ^ ROTR(x, 19) ^ ((x) >> 10))
+
+static void
+SHA256_Transform(uint32_t *state, const uint8_t *block)
+{
+	uint32_t w[64], s[8], t1, t2;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)block[i * 4] << 24 |
+		    (uint32_t)block[i * 4 + 1] << 16 |
+		    (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	for (; i < 64; i++)
+		w[i] = s1(w[i - 2]) + w[i - 7] + s0(w[i - 15]) + w[i - 16];
+	memcpy(s, state, sizeof(s));
+	for (i = 0; i < 64; i++) {
+		t1 = s[7] + S1(s[4]) + CH(s[4], s[5], s[6]) + sha256_k[i] +
+		    w[i];
+		t2 = S0(s[0]) + MAJ(s[0], s[1], s[2]);
+		s[7] = s[6];
+		s[6] = s[5];
+		s[5] = s[4];
+		s[4] = s[3] + t1;
+		s[3] = s[2];
+		s[2] = s[1];
+		s[1] = s[0];
+		s[0] = t1 + t2;
+	}
+	for (i = 0; i < 8; i++)
+		state[i] += s[i];
+}
+
+void
+SHA256_Init(SHA256_CTX *ctx)
+{
+	static const uint32_t iv[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	memcpy(ctx->state, iv, sizeof(iv));
+	ctx->count = 0;
+}
+
+void
+SHA256_Update(SHA256_CTX *ctx, const void *in, size_t len)
+{
+	const uint8_t *src = in;
+	size_t r, n;
+
+	r = ctx->count % SHA256_BLOCK_LENGTH;
+	ctx->count += len;
+	if (r > 0) {
+		n = MIN(len, SHA256_BLOCK_LENGTH - r);
+		memcpy(&ctx->buf[r], src, n);
+		src += n;
+		len -= n;
+		if (r + n < SHA256_BLOCK_LENGTH)
+			return;
+		SHA256_Transform(ctx->state, ctx->buf);
+	}
+	for (; len >= SHA256_BLOCK_LENGTH; len -= SHA256_BLOCK_LENGTH) {
+		SHA256_Transform(ctx->state, src);
+		src += SHA256_BLOCK_LENGTH;
+	}
+	memcpy(ctx->buf, src, len);
+}
+
+void
+SHA256_Final(uint8_t digest[SHA256_DIGEST_LENGTH], SHA256_CTX *ctx)
+{
+	uint64_t bits;
+	size_t r;
+	int i;
+
+	bits = ctx->count * 8;
+	r = ctx->count % SHA256_BLOCK_LENGTH;
+	ctx->buf[r++] = 0x80;
+	if (r > SHA256_BLOCK_LENGTH - 8) {
+		memset(&ctx->buf[r], 0, SHA256_BLOCK_LENGTH - r);
+		SHA256_Transform(ctx->state, ctx->buf);
+		r = 0;
+	}
+	memset(&ctx->buf[r], 0, SHA256_BLOCK_LENGTH - 8 - r);
+	for (i = 0; i < 8; i++)
+		ctx->buf[SHA256_BLOCK_LENGTH - 1 - i] = bits >> (i * 8);
+	SHA256_Transform(ctx->state, ctx->buf);
+	for (i = 0; i < 8; i++) {
+		digest[i * 4] = ctx->state[i] >> 24;
+		digest[i * 4 + 1] = ctx->state[i] >> 16;
+		digest[i * 4 + 2] = ctx->state[i] >> 8;
+		digest[i * 4 + 3] = ctx->state[i];
+	}
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+#undef	ROTR
+#undef	CH
+#undef	MAJ
+#undef	S0
+#undef	S1
+#undef	s0
+#undef	s1
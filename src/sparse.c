@@ -0,0 +1,495 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * The sparse image, a file that describes an image of a device by the
+ * extents written to it. It starts with a header of SPARSE_HDRSIZE
+ * bytes, followed by the data of the extents in the order they were
+ * written, the table of extents and a trailer that locates the table,
+ * so that it can be written in one forward pass. Blocks of zeros are
+ * kept as extents without data. The table is sorted by offset and its
+ * extents do not overlap; data of an extent that was later written
+ * over is left where it is. All numbers are little endian.
+ *
+ * A sparse image can also be sent as a stream, for a pipe: the header,
+ * then a record for each extent in ascending order of offset, each
+ * followed by its data, and an end record.
+ */
+
+#include <endian.h>
+#include <pthread.h>
+#include <sys/uio.h>
+
+#define	SPARSE_MAGIC	"UFSSPIMG"	/* at the start of the header */
+#define	SPARSE_EMAGIC	"UFSSPEND"	/* at the start of the trailer */
+#define	SPARSE_SMAGIC	"UFSSPSTR"	/* at the start of a stream */
+#define	SPARSE_VERSION	1
+#define	SPARSE_HDRSIZE	4096		/* data starts after the header */
+#define	SPARSE_ZBLK	4096		/* granularity of zero detection */
+#define	SPARSE_ZERO	UINT64_MAX	/* se_data of an extent of zeros */
+
+struct sparsehdr {
+	char		sh_magic[8];	/* SPARSE_MAGIC */
+	uint32_t	sh_version;	/* SPARSE_VERSION */
+	uint32_t	sh_sectorsize;	/* logical sector size of the image */
+	uint64_t	sh_size;	/* size of the image in bytes */
+	uint32_t	sh_pad;
+	uint32_t	sh_crc;		/* CRC32C of the bytes above */
+};
+
+struct sparseext {
+	uint64_t	se_off;		/* offset in the image */
+	uint64_t	se_len;		/* length in bytes */
+	uint64_t	se_data;	/* offset of its data, or SPARSE_ZERO */
+	uint32_t	se_crc;		/* CRC32C of its data */
+	uint32_t	se_pad;
+};
+
+struct sparserec {
+	uint64_t	sr_off;		/* offset, or number of extents at end */
+	uint64_t	sr_len;		/* length, or bytes of data at end */
+	uint32_t	sr_flags;
+#define	SR_ZERO		0x01		/* extent of zeros, without data */
+#define	SR_END		0x02		/* end of the stream */
+	uint32_t	sr_crc;		/* CRC32C of the data */
+};
+
+struct sparsetrailer {
+	char		st_magic[8];	/* SPARSE_EMAGIC */
+	uint64_t	st_table;	/* offset of the table of extents */
+	uint64_t	st_next;	/* number of extents in it */
+	uint32_t	st_tablecrc;	/* CRC32C of the table */
+	uint32_t	st_crc;		/* CRC32C of the bytes above */
+};
+
+static struct {
+	int		 sp_open;	/* writes go to a sparse image */
+	int		 sp_fd;		/* the sparse image */
+	off_t		 sp_end;	/* where the next data goes */
+	uint64_t	 sp_size;	/* size of the image */
+	struct sparseext *sp_ext;	/* extents in memory order */
+	size_t		 sp_next;
+	size_t		 sp_maxext;
+	pthread_mutex_t	 sp_lock;
+} sparse = { .sp_lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint32_t
+sparsecrc(const void *buf, size_t len)
+{
+
+	return (calculate_crc32c(~0U, buf, len) ^ ~0U);
+}
+
+/*
+ * Index of the first extent that ends after off.
+ */
+static size_t
+sparsefind(uint64_t off)
+{
+	size_t lo, hi, mid;
+
+	lo = 0;
+	hi = sparse.sp_next;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (sparse.sp_ext[mid].se_off + sparse.sp_ext[mid].se_len <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return (lo);
+}
+
+/*
+ * Enter an extent in the table, cutting back or splitting any that it
+ * overlaps. Writes mostly come in ascending order, so it is usually
+ * added at the end.
+ */
+static void
+sparseenter(uint64_t off, uint64_t len, uint64_t data)
+{
+	struct sparseext *se, tail;
+	uint64_t end, cut;
+	size_t i, j;
+
+	end = off + len;
+	if (sparse.sp_next + 2 > sparse.sp_maxext) {
+		sparse.sp_maxext = MAX(1024, 2 * sparse.sp_maxext);
+		if ((sparse.sp_ext = realloc(sparse.sp_ext,
+		    sparse.sp_maxext * sizeof(*sparse.sp_ext))) == NULL)
+			errx(31, "realloc failed");
+	}
+	i = sparsefind(off);
+	se = &sparse.sp_ext[i];
+	if (i < sparse.sp_next && se->se_off < off) {
+		/* Keep the head of an extent that starts before this one. */
+		if (se->se_off + se->se_len > end) {
+			tail = *se;
+			cut = end - tail.se_off;
+			tail.se_off += cut;
+			tail.se_len -= cut;
+			if (tail.se_data != SPARSE_ZERO)
+				tail.se_data += cut;
+			memmove(se + 1, se, (sparse.sp_next - i) * sizeof(*se));
+			sparse.sp_next++;
+			se[1] = tail;
+		}
+		se->se_len = off - se->se_off;
+		se++;
+		i++;
+	}
+	for (j = i; j < sparse.sp_next &&
+	    sparse.sp_ext[j].se_off + sparse.sp_ext[j].se_len <= end; j++)
+		continue;
+	if (j < sparse.sp_next && sparse.sp_ext[j].se_off < end) {
+		/* Keep the tail of an extent that ends after this one. */
+		cut = end - sparse.sp_ext[j].se_off;
+		sparse.sp_ext[j].se_off += cut;
+		sparse.sp_ext[j].se_len -= cut;
+		if (sparse.sp_ext[j].se_data != SPARSE_ZERO)
+			sparse.sp_ext[j].se_data += cut;
+	}
+	if (j != i + 1)
+		memmove(&sparse.sp_ext[i + 1], &sparse.sp_ext[j],
+		    (sparse.sp_next - j) * sizeof(*se));
+	sparse.sp_next += i + 1 - j;
+	se = &sparse.sp_ext[i];
+	se->se_off = off;
+	se->se_len = len;
+	se->se_data = data;
+	se->se_crc = 0;
+}
+
+/*
+ * Write to the image, appending the data that is not all zeros to the
+ * sparse image.
+ */
+static int
+sparsewrite(const void *buf, size_t size, off_t off)
+{
+	const char *p, *q;
+	size_t n, run;
+	int zero;
+
+	pthread_mutex_lock(&sparse.sp_lock);
+	for (p = buf; size > 0; p += run, off += run, size -= run) {
+		zero = -1;
+		for (run = 0, q = p; run < size; run += n, q += n) {
+			n = MIN(size - run, SPARSE_ZBLK - (off + run) %
+			    SPARSE_ZBLK);
+			if (zero == -1)
+				zero = q[0] == 0 && memcmp(q, q + 1, n - 1) == 0;
+			else if (zero != (q[0] == 0 &&
+			    memcmp(q, q + 1, n - 1) == 0))
+				break;
+		}
+		if (zero) {
+			sparseenter(off, run, SPARSE_ZERO);
+			continue;
+		}
+		if (pwrite(sparse.sp_fd, p, run, sparse.sp_end) !=
+		    (ssize_t)run) {
+			pthread_mutex_unlock(&sparse.sp_lock);
+			return (-1);
+		}
+		sparseenter(off, run, sparse.sp_end);
+		sparse.sp_end += run;
+	}
+	pthread_mutex_unlock(&sparse.sp_lock);
+	return (0);
+}
+
+/*
+ * Read from the image: what was written, and zeros elsewhere.
+ */
+static int
+sparseread(void *buf, size_t size, off_t off)
+{
+	struct sparseext *se;
+	uint64_t from, to;
+	size_t i;
+	int error;
+
+	memset(buf, 0, size);
+	error = 0;
+	pthread_mutex_lock(&sparse.sp_lock);
+	for (i = sparsefind(off); i < sparse.sp_next && error == 0; i++) {
+		se = &sparse.sp_ext[i];
+		if (se->se_off >= off + size)
+			break;
+		if (se->se_data == SPARSE_ZERO)
+			continue;
+		from = MAX(se->se_off, (uint64_t)off);
+		to = MIN(se->se_off + se->se_len, off + size);
+		if (pread(sparse.sp_fd, (char *)buf + (from - off), to - from,
+		    se->se_data + (from - se->se_off)) != (ssize_t)(to - from))
+			error = -1;
+	}
+	pthread_mutex_unlock(&sparse.sp_lock);
+	return (error);
+}
+
+/*
+ * Reads and writes of the device, which go to the sparse image if one
+ * is being made. They return the number of bytes done or -1. Writes
+ * to the device are held to the rate limits and may have faults
+ * injected.
+ */
+ssize_t
+dpread(int fd, void *buf, size_t size, off_t off)
+{
+
+	if (!sparse.sp_open)
+		return (pread(fd, buf, size, off));
+	if ((uint64_t)off >= sparse.sp_size)
+		return (0);
+	size = MIN(size, sparse.sp_size - off);
+	return (sparseread(buf, size, off) == 0 ? (ssize_t)size : -1);
+}
+
+ssize_t
+dpwrite(int fd, const void *buf, size_t size, off_t off)
+{
+	uint64_t start;
+	ssize_t n;
+
+	if (!sparse.sp_open) {
+		start = ratewait(size);
+		n = faulting ? faultwrite(off, size) : (ssize_t)size;
+		if (n > 0)
+			n = pwrite(fd, buf, n, off);
+		ratedone(start);
+		return (n);
+	}
+	if ((uint64_t)off + size > sparse.sp_size) {
+		errno = ENOSPC;
+		return (-1);
+	}
+	return (sparsewrite(buf, size, off) == 0 ? (ssize_t)size : -1);
+}
+
+/*
+ * Write the first size bytes of an iovec, for a short write.
+ */
+static ssize_t
+pwritevpart(int fd, const struct iovec *iov, ssize_t size, off_t off)
+{
+	ssize_t n, done;
+
+	for (done = 0; done < size; done += n, iov++) {
+		n = MIN((ssize_t)iov->iov_len, size - done);
+		if ((n = pwrite(fd, iov->iov_base, n, off + done)) <= 0)
+			return (done > 0 ? done : n);
+	}
+	return (done);
+}
+
+ssize_t
+dpwritev(int fd, const struct iovec *iov, int iovcnt, off_t off)
+{
+	uint64_t start;
+	ssize_t n, done;
+	int i;
+
+	if (!sparse.sp_open) {
+		for (done = 0, i = 0; i < iovcnt; i++)
+			done += iov[i].iov_len;
+		start = ratewait(done);
+		n = faulting ? faultwrite(off, done) : done;
+		if (n == done)
+			n = pwritev(fd, iov, iovcnt, off);
+		else if (n > 0)
+			n = pwritevpart(fd, iov, n, off);
+		ratedone(start);
+		return (n);
+	}
+	for (done = 0, i = 0; i < iovcnt; i++, done += n)
+		if ((n = dpwrite(fd, iov[i].iov_base, iov[i].iov_len,
+		    off + done)) == -1)
+			return (-1);
+	return (done);
+}
+
+/*
+ * Start a sparse image of size bytes in fd, which is empty.
+ */
+void
+sparseopen(int fd, uint64_t size)
+{
+
+	sparse.sp_fd = fd;
+	sparse.sp_size = size;
+	sparse.sp_end = SPARSE_HDRSIZE;
+	sparse.sp_next = 0;
+	sparse.sp_open = 1;
+}
+
+static void
+sparsehdr(struct sparsehdr *sh, const char *magic)
+{
+
+	memset(sh, 0, sizeof(*sh));
+	memcpy(sh->sh_magic, magic, sizeof(sh->sh_magic));
+	sh->sh_version = htole32(SPARSE_VERSION);
+	sh->sh_sectorsize = htole32(sectorsize);
+	sh->sh_size = htole64(sparse.sp_size);
+	sh->sh_crc = htole32(sparsecrc(sh, offsetof(struct sparsehdr,
+	    sh_crc)));
+}
+
+static int
+writeall(int fd, const void *buf, size_t size)
+{
+	const char *p;
+	ssize_t n;
+
+	for (p = buf; size > 0; p += n, size -= n)
+		if ((n = write(fd, p, size)) <= 0)
+			return (-1);
+	return (0);
+}
+
+/*
+ * Send the image written so far to fd as a stream, which is written
+ * strictly forward and can be a pipe, and discard it.
+ */
+int
+sparsestream(int fd)
+{
+	struct sparsehdr sh;
+	struct sparserec sr;
+	struct sparseext *se;
+	uint64_t total;
+	size_t i;
+	char *data;
+	int error;
+
+	if (!sparse.sp_open)
+		return (0);
+	sparse.sp_open = 0;
+	sparsehdr(&sh, SPARSE_SMAGIC);
+	error = writeall(fd, &sh, sizeof(sh));
+	data = NULL;
+	total = 0;
+	for (i = 0; i < sparse.sp_next && error == 0; i++) {
+		se = &sparse.sp_ext[i];
+		memset(&sr, 0, sizeof(sr));
+		sr.sr_off = htole64(se->se_off);
+		sr.sr_len = htole64(se->se_len);
+		if (se->se_data == SPARSE_ZERO) {
+			sr.sr_flags = htole32(SR_ZERO);
+			error = writeall(fd, &sr, sizeof(sr));
+			continue;
+		}
+		if ((data = realloc(data, se->se_len)) == NULL)
+			errx(31, "realloc failed");
+		if (pread(sparse.sp_fd, data, se->se_len, se->se_data) !=
+		    (ssize_t)se->se_len) {
+			error = -1;
+			break;
+		}
+		sr.sr_crc = htole32(sparsecrc(data, se->se_len));
+		error = writeall(fd, &sr, sizeof(sr));
+		if (error == 0)
+			error = writeall(fd, data, se->se_len);
+		total += se->se_len;
+	}
+	free(data);
+	memset(&sr, 0, sizeof(sr));
+	sr.sr_off = htole64(sparse.sp_next);
+	sr.sr_len = htole64(total);
+	sr.sr_flags = htole32(SR_END);
+	if (error == 0)
+		error = writeall(fd, &sr, sizeof(sr));
+	free(sparse.sp_ext);
+	sparse.sp_ext = NULL;
+	sparse.sp_next = sparse.sp_maxext = 0;
+	return (error);
+}
+
+/*
+ * Finish the sparse image with its header, table and trailer.
+ */
+int
+sparseclose(void)
+{
+	struct sparsehdr sh;
+	struct sparsetrailer st;
+	struct sparseext *se;
+	char *hdr, *data;
+	size_t i, tsize;
+	int error;
+
+	if (!sparse.sp_open)
+		return (0);
+	sparse.sp_open = 0;
+	error = 0;
+	data = NULL;
+	for (i = 0; i < sparse.sp_next && error == 0; i++) {
+		se = &sparse.sp_ext[i];
+		if (se->se_data == SPARSE_ZERO)
+			continue;
+		if ((data = realloc(data, se->se_len)) == NULL)
+			errx(31, "realloc failed");
+		if (pread(sparse.sp_fd, data, se->se_len, se->se_data) !=
+		    (ssize_t)se->se_len)
+			error = -1;
+		se->se_crc = sparsecrc(data, se->se_len);
+	}
+	free(data);
+	for (i = 0; i < sparse.sp_next; i++) {
+		se = &sparse.sp_ext[i];
+		se->se_off = htole64(se->se_off);
+		se->se_len = htole64(se->se_len);
+		se->se_data = htole64(se->se_data);
+		se->se_crc = htole32(se->se_crc);
+		se->se_pad = 0;
+	}
+	tsize = sparse.sp_next * sizeof(*sparse.sp_ext);
+	if (error == 0 && pwrite(sparse.sp_fd, sparse.sp_ext, tsize,
+	    sparse.sp_end) != (ssize_t)tsize)
+		error = -1;
+	memset(&st, 0, sizeof(st));
+	memcpy(st.st_magic, SPARSE_EMAGIC, sizeof(st.st_magic));
+	st.st_table = htole64(sparse.sp_end);
+	st.st_next = htole64(sparse.sp_next);
+	st.st_tablecrc = htole32(sparsecrc(sparse.sp_ext, tsize));
+	st.st_crc = htole32(sparsecrc(&st, offsetof(struct sparsetrailer,
+	    st_crc)));
+	if (error == 0 && pwrite(sparse.sp_fd, &st, sizeof(st),
+	    sparse.sp_end + tsize) != sizeof(st))
+		error = -1;
+	if ((hdr = calloc(1, SPARSE_HDRSIZE)) == NULL)
+		errx(31, "calloc failed");
+	sparsehdr(&sh, SPARSE_MAGIC);
+	memcpy(hdr, &sh, sizeof(sh));
+	if (error == 0 && pwrite(sparse.sp_fd, hdr, SPARSE_HDRSIZE, 0) !=
+	    SPARSE_HDRSIZE)
+		error = -1;
+	free(hdr);
+	free(sparse.sp_ext);
+	sparse.sp_ext = NULL;
+	sparse.sp_next = sparse.sp_maxext = 0;
+	return (error);
+}
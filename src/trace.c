@@ -0,0 +1,169 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * A tracer for the operations on the hot paths of a format, kept in a
+ * ring buffer in memory and written out as Chrome trace JSON when the
+ * program exits, to be opened in chrome://tracing or Perfetto. Each
+ * event is a complete ("X") event with its start, its duration and up
+ * to two named arguments, on the thread that made it. When tracing is
+ * off a tracepoint costs a test of a global.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/syscall.h>
+
+#define	TRACEMAX	(1 << 18)	/* events kept, the latest ones */
+
+struct tevent {
+	const char	*te_name;	/* static string naming the event */
+	uint64_t	 te_start;	/* ns since the tracer started */
+	uint64_t	 te_dur;	/* ns */
+	const char	*te_k0;		/* names of the arguments, or NULL */
+	const char	*te_k1;
+	int64_t		 te_v0;		/* values of the arguments */
+	int64_t		 te_v1;
+	int		 te_tid;	/* thread that made the event */
+};
+
+int	tracing;			/* tracepoints are enabled */
+static struct tevent *tevents;
+static uint64_t tnext;			/* events made so far */
+static uint64_t tbase;			/* time the tracer started */
+static const char *tfile;
+static __thread int ttid;
+
+uint64_t
+tracenow(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * The start time to be given to trace(), or 0 when not tracing.
+ */
+static inline uint64_t
+tracestart(void)
+{
+
+	return (tracing ? tracenow() : 0);
+}
+
+static void
+trace1(const char *name, uint64_t start, const char *k0, int64_t v0,
+    const char *k1, int64_t v1)
+{
+	struct tevent *te;
+	uint64_t now;
+
+	now = tracenow();
+	if (ttid == 0)
+		ttid = syscall(SYS_gettid);
+	te = &tevents[__atomic_fetch_add(&tnext, 1, __ATOMIC_RELAXED) %
+	    TRACEMAX];
+	te->te_name = name;
+	te->te_start = start - tbase;
+	te->te_dur = now - start;
+	te->te_k0 = k0;
+	te->te_v0 = v0;
+	te->te_k1 = k1;
+	te->te_v1 = v1;
+	te->te_tid = ttid;
+}
+
+/*
+ * Record an event that started at "start" and ends now.
+ */
+static inline void
+trace(const char *name, uint64_t start, const char *k0, int64_t v0,
+    const char *k1, int64_t v1)
+{
+
+	if (tracing)
+		trace1(name, start, k0, v0, k1, v1);
+}
+
+static void
+tracedump(void)
+{
+	struct tevent *te;
+	uint64_t i, first;
+	FILE *fp;
+	int sep;
+
+	tracing = 0;
+	if (strcmp(tfile, "-") == 0)
+		fp = stderr;
+	else if ((fp = fopen(tfile, "w")) == NULL) {
+		warn("%s", tfile);
+		return;
+	}
+	first = tnext > TRACEMAX ? tnext - TRACEMAX : 0;
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (i = first, sep = ' '; i < tnext; i++, sep = ',') {
+		te = &tevents[i % TRACEMAX];
+		fprintf(fp, "%c{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,"
+		    "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{", sep,
+		    te->te_name, (int)getpid(), te->te_tid,
+		    te->te_start / 1000.0, te->te_dur / 1000.0);
+		if (te->te_k0 != NULL)
+			fprintf(fp, "\"%s\":%jd", te->te_k0,
+			    (intmax_t)te->te_v0);
+		if (te->te_k1 != NULL)
+			fprintf(fp, ",\"%s\":%jd", te->te_k1,
+			    (intmax_t)te->te_v1);
+		fprintf(fp, "}}\n");
+	}
+	fprintf(fp, "]}\n");
+	if (first > 0)
+		warnx("%s: only the last %d of %ju events were kept", tfile,
+		    TRACEMAX, (uintmax_t)tnext);
+	if (fp != stderr)
+		fclose(fp);
+}
+
+/*
+ * Start tracing, to be written to file ("-" for standard error) at exit.
+ */
+void
+traceopen(const char *file)
+{
+
+	if ((tevents = calloc(TRACEMAX, sizeof(*tevents))) == NULL)
+		errx(31, "calloc failed");
+	tfile = file;
+	tbase = tracenow();
+	tracing = 1;
+	atexit(tracedump);
+}
@@ -0,0 +1,154 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * The namespace to be created by fsinit(), collected from the command
+ * line before the file system geometry is known. Inode numbers are
+ * only assigned once the directories are laid out.
+ */
+struct fsnode {
+	char		*fn_name;	/* name in parent directory */
+	int		 fn_type;	/* DT_DIR or DT_REG */
+	ino_t		 fn_ino;	/* inode number once allocated */
+	struct prealloc	*fn_pa;		/* contents of a regular file */
+	struct fsnode	*fn_parent;	/* containing directory */
+	struct fsnode	**fn_child;	/* entries of a directory */
+	int		 fn_nchild;	/* number of entries */
+	int		 fn_maxchild;	/* space allocated for entries */
+	int		 fn_ndirs;	/* number of subdirectories */
+};
+
+struct fsnode fsroot = { "", DT_DIR, UFS_ROOTINO, NULL, &fsroot, NULL, 0,
+    0, 0 };
+int fsnnodes;			/* number of entries below fsroot */
+
+/*
+ * Add an entry to a directory without looking for an existing one.
+ */
+static struct fsnode *
+fsappend(struct fsnode *dir, const char *name, int type)
+{
+	struct fsnode *np;
+
+	if (dir->fn_nchild == dir->fn_maxchild) {
+		dir->fn_maxchild = MAX(16, 2 * dir->fn_maxchild);
+		dir->fn_child = realloc(dir->fn_child,
+		    dir->fn_maxchild * sizeof(*dir->fn_child));
+		if (dir->fn_child == NULL)
+			errx(1, "realloc failed");
+	}
+	if ((np = calloc(1, sizeof(*np))) == NULL ||
+	    (np->fn_name = strdup(name)) == NULL)
+		errx(1, "calloc failed");
+	np->fn_type = type;
+	np->fn_parent = dir;
+	dir->fn_child[dir->fn_nchild++] = np;
+	fsnnodes++;
+	if (type == DT_DIR)
+		dir->fn_ndirs++;
+	return (np);
+}
+
+/*
+ * Look up a name in a directory, entering it if it is not there.
+ * It is an error for an existing name to be of a different type.
+ */
+static struct fsnode *
+fsenter(struct fsnode *dir, const char *name, int type)
+{
+	struct fsnode *np;
+	int i;
+
+	for (i = 0; i < dir->fn_nchild; i++) {
+		np = dir->fn_child[i];
+		if (strcmp(np->fn_name, name) != 0)
+			continue;
+		if (np->fn_type != type || type == DT_REG)
+			return (NULL);
+		return (np);
+	}
+	return (fsappend(dir, name, type));
+}
+
+/*
+ * Enter a path relative to the root directory, creating any missing
+ * intermediate directories. Return NULL if the path is not usable.
+ */
+struct fsnode *
+fsmkpath(const char *path, int type)
+{
+	struct fsnode *dir;
+	char *buf, *cp, *name;
+
+	if ((buf = strdup(path)) == NULL)
+		errx(1, "strdup failed");
+	dir = &fsroot;
+	for (cp = buf; dir != NULL && cp != NULL; ) {
+		name = strsep(&cp, "/");
+		if (*name == '\0')
+			continue;
+		while (cp != NULL && *cp == '/')
+			cp++;
+		if (strlen(name) > UFS_MAXNAMLEN || strcmp(name, ".") == 0 ||
+		    strcmp(name, "..") == 0 || (dir == &fsroot &&
+		    (strcmp(name, ".snap") == 0 || strcmp(name, SUJ_FILE) == 0)))
+			dir = NULL;
+		else if (cp == NULL || *cp == '\0')
+			dir = fsenter(dir, name, type);
+		else
+			dir = fsenter(dir, name, DT_DIR);
+	}
+	if (dir == &fsroot)
+		dir = NULL;
+	free(buf);
+	return (dir);
+}
+
+/*
+ * Enter "levels" levels of "fanout" subdirectories below a path, named
+ * with fixed width hexadecimal numbers such as 00 through ff. Names need
+ * not be looked up in a directory that was empty to begin with.
+ */
+static void
+fsshard(struct fsnode *dir, int fanout, int levels)
+{
+	struct fsnode *np;
+	char name[16];
+	int fresh, i, width;
+
+	if (levels == 0)
+		return;
+	for (width = 1; width < 4 && (1 << (4 * width)) < fanout; width++)
+		continue;
+	fresh = dir->fn_nchild == 0;
+	for (i = 0; i < fanout; i++) {
+		snprintf(name, sizeof(name), "%0*x", width, i);
+		if (fresh)
+			np = fsappend(dir, name, DT_DIR);
+		else if ((np = fsenter(dir, name, DT_DIR)) == NULL)
+			errx(1, "%s: is a file", name);
+		fsshard(np, fanout, levels - 1);
+	}
+}
@@ -0,0 +1,262 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * tunefs.ufs: change the tunable parameters of an existing file system.
+ *
+ * The superblock is edited in memory and written back to every
+ * cylinder group and then to its primary location, so the backups
+ * never disagree with it. The file system must not be mounted.
+ */
+
+#include "trace.c"
+#include "crc32.c"
+#include "fs.h"
+#include "mkfsufs.h"
+#include "arena.c"
+#include "rate.c"
+#include "fault.c"
+#include "sparse.c"
+#include "plan.c"
+#include "sblock.c"
+
+static const char *
+onoff(int set)
+{
+
+	return (set ? "enabled" : "disabled");
+}
+
+/*
+ * Parse the argument of an option taking "enable" or "disable".
+ */
+static int
+getonoff(int ch, const char *arg)
+{
+
+	if (strcmp(arg, "enable") == 0)
+		return (1);
+	if (strcmp(arg, "disable") == 0)
+		return (0);
+	errx(10, "bad -%c flag: %s, must be enable or disable", ch, arg);
+}
+
+static int
+getnum(int ch, const char *arg, intmax_t min, intmax_t max)
+{
+	intmax_t n;
+	char *ep;
+
+	errno = 0;
+	n = strtoimax(arg, &ep, 10);
+	if (errno != 0 || *ep != '\0' || ep == arg || n < min || n > max)
+		errx(10, "bad -%c value: %s, must be between %jd and %jd", ch,
+		    arg, min, max);
+	return (n);
+}
+
+static void
+setflag(int32_t flag, int on, const char *name)
+{
+
+	if (((sblock.fs_flags & flag) != 0) == on) {
+		warnx("%s remains unchanged as %s", name, onoff(on));
+		return;
+	}
+	if (on)
+		sblock.fs_flags |= flag;
+	else
+		sblock.fs_flags &= ~flag;
+	warnx("%s %s", name, on ? "set" : "cleared");
+}
+
+static void
+printfs(void)
+{
+
+	printf("POSIX.1e ACLs: (-a)                                %s\n",
+	    onoff(sblock.fs_flags & FS_ACLS));
+	printf("NFSv4 ACLs: (-N)                                   %s\n",
+	    onoff(sblock.fs_flags & FS_NFS4ACLS));
+	printf("MAC multilabel: (-l)                               %s\n",
+	    onoff(sblock.fs_flags & FS_MULTILABEL));
+	printf("soft updates: (-n)                                 %s\n",
+	    onoff(sblock.fs_flags & FS_DOSOFTDEP));
+	printf("soft update journaling:                            %s\n",
+	    onoff(sblock.fs_flags & FS_SUJ));
+	printf("gjournal: (-J)                                     %s\n",
+	    onoff(sblock.fs_flags & FS_GJOURNAL));
+	printf("trim: (-t)                                         %s\n",
+	    onoff(sblock.fs_flags & FS_TRIM));
+	printf("maximum blocks per file in a cylinder group: (-e)  %d\n",
+	    sblock.fs_maxbpg);
+	printf("average file size: (-f)                            %d\n",
+	    sblock.fs_avgfilesize);
+	printf("average number of files in a directory: (-s)       %d\n",
+	    sblock.fs_avgfpdir);
+	printf("minimum percentage of free space: (-m)             %d%%\n",
+	    sblock.fs_minfree);
+	printf("space to hold for metadata blocks: (-k)            %jd\n",
+	    (intmax_t)sblock.fs_metaspace);
+	printf("optimization preference: (-o)                      %s\n",
+	    sblock.fs_optim == FS_OPTSPACE ? "space" : "time");
+	if (sblock.fs_minfree >= MINFREE && sblock.fs_optim == FS_OPTSPACE)
+		warnx("should optimize for time with minfree >= %d%%",
+		    MINFREE);
+	if (sblock.fs_minfree < MINFREE && sblock.fs_optim == FS_OPTTIME)
+		warnx("should optimize for space with minfree < %d%%",
+		    MINFREE);
+	printf("volume label: (-L)                                 %s\n",
+	    sblock.fs_volname);
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr,
+	    "usage: tunefs.ufs [-p] [-a enable | disable] [-e maxbpg] "
+	    "[-f avgfilesize]\n"
+	    "                  [-J enable | disable] [-k metaspace] "
+	    "[-L volname]\n"
+	    "                  [-l enable | disable] [-m minfree] "
+	    "[-N enable | disable]\n"
+	    "                  [-n enable | disable] [-o space | time] "
+	    "[-s avgfpdir]\n"
+	    "                  [-t enable | disable] special-device\n");
+	exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int ch, i, pflag, changed;
+
+	pflag = changed = 0;
+	if (argc < 3)
+		usage();
+	/*
+	 * The superblock is needed to check some of the values, so the
+	 * device is opened before the options are applied.
+	 */
+	d_name = argv[argc - 1];
+	if ((d_fd = open(d_name, O_RDWR)) < 0)
+		err(1, "%s", d_name);
+	sectorsize = DEV_BSIZE;
+	if (sbread() != 0)
+		errx(1, "%s: %s", d_name, d_err);
+	argc--;
+	while ((ch = getopt(argc, argv, "a:e:f:J:k:L:l:m:N:n:o:ps:t:")) != -1) {
+		changed |= ch != 'p';
+		switch (ch) {
+		case 'a':
+			if (getonoff(ch, optarg) &&
+			    (sblock.fs_flags & FS_NFS4ACLS) != 0)
+				errx(10, "POSIX.1e ACLs and NFSv4 ACLs are "
+				    "mutually exclusive");
+			setflag(FS_ACLS, getonoff(ch, optarg), "POSIX.1e ACLs");
+			break;
+		case 'e':
+			sblock.fs_maxbpg = getnum(ch, optarg, 1, INT_MAX);
+			break;
+		case 'f':
+			sblock.fs_avgfilesize = getnum(ch, optarg, 1, INT_MAX);
+			break;
+		case 'J':
+			setflag(FS_GJOURNAL, getonoff(ch, optarg), "gjournal");
+			break;
+		case 'k':
+			sblock.fs_metaspace = blknum(&sblock,
+			    getnum(ch, optarg, 0, sblock.fs_fpg / 2));
+			break;
+		case 'L':
+			for (i = 0; isalnum(optarg[i]) || optarg[i] == '_' ||
+			    optarg[i] == '-'; i++)
+				continue;
+			if (optarg[i] != '\0')
+				errx(10, "bad volume label. Valid characters "
+				    "are alphanumerics, dashes, and underscores.");
+			if (strlen(optarg) >= MAXVOLLEN)
+				errx(10, "bad volume label. Length is longer "
+				    "than %d.", MAXVOLLEN);
+			memset(sblock.fs_volname, 0, MAXVOLLEN);
+			strlcpy((char *)sblock.fs_volname, optarg, MAXVOLLEN);
+			break;
+		case 'l':
+			setflag(FS_MULTILABEL, getonoff(ch, optarg),
+			    "MAC multilabel");
+			break;
+		case 'm':
+			sblock.fs_minfree = getnum(ch, optarg, 0, 99);
+			break;
+		case 'N':
+			if (getonoff(ch, optarg) &&
+			    (sblock.fs_flags & FS_ACLS) != 0)
+				errx(10, "POSIX.1e ACLs and NFSv4 ACLs are "
+				    "mutually exclusive");
+			setflag(FS_NFS4ACLS, getonoff(ch, optarg), "NFSv4 ACLs");
+			break;
+		case 'n':
+			/*
+			 * The journal is of no use without soft updates.
+			 */
+			setflag(FS_DOSOFTDEP, getonoff(ch, optarg),
+			    "soft updates");
+			if ((sblock.fs_flags & FS_DOSOFTDEP) == 0)
+				sblock.fs_flags &= ~FS_SUJ;
+			break;
+		case 'o':
+			if (strcmp(optarg, "space") == 0)
+				sblock.fs_optim = FS_OPTSPACE;
+			else if (strcmp(optarg, "time") == 0)
+				sblock.fs_optim = FS_OPTTIME;
+			else
+				errx(10, "bad -o value: %s, must be space or "
+				    "time", optarg);
+			break;
+		case 'p':
+			pflag = 1;
+			break;
+		case 's':
+			sblock.fs_avgfpdir = getnum(ch, optarg, 1, INT_MAX);
+			break;
+		case 't':
+			setflag(FS_TRIM, getonoff(ch, optarg), "trim");
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+	if (pflag)
+		printfs();
+	if (changed) {
+		if (sbput(d_fd, &sblock, sblock.fs_ncg) != 0)
+			err(11, "%s: can't write superblock", d_name);
+	}
+	close(d_fd);
+	return (0);
+}
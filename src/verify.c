@@ -0,0 +1,336 @@
+/*-
+ * SPDX-License-Identifier: BSD-2-Clause
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+
+/*
+ * Read back the metadata of a newly created file system and check it:
+ * the superblock and its backups, the cylinder groups, the summary
+ * information and the initialized inode blocks. Only the metadata at
+ * the start of each cylinder group is read, so the cost depends on the
+ * number of cylinder groups rather than on the size of the volume.
+ * Cylinder groups are checked by several threads at once, each reading
+ * a group's superblock and map in one request and its inodes in another.
+ */
+#define	MAXVERIFYTHREADS	32
+
+static struct fs *vfs;		/* superblock read back from disk */
+static struct csum *vcs;	/* summary information read back from disk */
+static int vfd = -1;		/* descriptor used for reading */
+static int vnextcg;		/* next cylinder group to be checked */
+static int verrors;		/* number of problems found */
+static int64_t vinodes;		/* number of inodes checked */
+static pthread_mutex_t vlock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+vcomplain(const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&vlock);
+	verrors++;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\n");
+	pthread_mutex_unlock(&vlock);
+}
+
+/*
+ * Read from the file system at a fragment address.
+ */
+static int
+vread(ufs2_daddr_t fsbno, void *buf, size_t size)
+{
+	off_t off;
+
+	off = (off_t)(part_ofs + fsbtodb(vfs, fsbno)) * sectorsize;
+	return (dpread(vfd, buf, size, off) == (ssize_t)size ? 0 : -1);
+}
+
+/*
+ * Compare the fields of a backup superblock that describe the layout
+ * of the file system with those of the primary superblock.
+ */
+static int
+sbmatch(struct fs *fs)
+{
+
+	return (fs->fs_magic == vfs->fs_magic &&
+	    fs->fs_sbsize == vfs->fs_sbsize &&
+	    fs->fs_size == vfs->fs_size &&
+	    fs->fs_ncg == vfs->fs_ncg &&
+	    fs->fs_bsize == vfs->fs_bsize &&
+	    fs->fs_fsize == vfs->fs_fsize &&
+	    fs->fs_fpg == vfs->fs_fpg &&
+	    fs->fs_ipg == vfs->fs_ipg &&
+	    fs->fs_sblkno == vfs->fs_sblkno &&
+	    fs->fs_cblkno == vfs->fs_cblkno &&
+	    fs->fs_iblkno == vfs->fs_iblkno &&
+	    fs->fs_dblkno == vfs->fs_dblkno &&
+	    fs->fs_csaddr == vfs->fs_csaddr &&
+	    fs->fs_cssize == vfs->fs_cssize &&
+	    fs->fs_cgsize == vfs->fs_cgsize);
+}
+
+static void
+verifycg(int cylno, char *buf)
+{
+	struct fs *fs;
+	struct cg *cgp;
+	struct csum cs;
+	struct ufs1_dinode *dp1;
+	struct ufs2_dinode *dp2;
+	uint32_t ckhash;
+	size_t hdrsize, inosize;
+	uint i, niblk;
+	int used, mode;
+
+	/*
+	 * The backup superblock and the cylinder group map lie next to
+	 * each other ahead of the inode blocks.
+	 */
+	hdrsize = lfragtosize(vfs, cgimin(vfs, cylno) - cgsblock(vfs, cylno));
+	if (vread(cgsblock(vfs, cylno), buf, hdrsize) != 0) {
+		vcomplain("cg %d: cannot read: %s", cylno, strerror(errno));
+		return;
+	}
+	fs = (struct fs *)buf;
+	if (!sbmatch(fs))
+		vcomplain("cg %d: backup superblock does not match", cylno);
+	else if ((fs->fs_metackhash & CK_SUPERBLOCK) != 0 &&
+	    ffs_calc_sbhash(fs) != fs->fs_ckhash)
+		vcomplain("cg %d: backup superblock check-hash is wrong",
+		    cylno);
+	cgp = (struct cg *)&buf[lfragtosize(vfs,
+	    cgtod(vfs, cylno) - cgsblock(vfs, cylno))];
+	if (cgp->cg_magic != CG_MAGIC || cgp->cg_cgx != (uint)cylno) {
+		vcomplain("cg %d: bad magic number", cylno);
+		return;
+	}
+	if ((vfs->fs_metackhash & CK_CYLGRP) != 0) {
+		ckhash = cgp->cg_ckhash;
+		cgp->cg_ckhash = 0;
+		if (calculate_crc32c(~0L, (void *)cgp, vfs->fs_cgsize) != ckhash)
+			vcomplain("cg %d: check-hash is wrong", cylno);
+		cgp->cg_ckhash = ckhash;
+	}
+
+	/*
+	 * The counts kept in the map, in the summary information and in
+	 * memory must all agree with what the maps say.
+	 */
+	memset(&cs, 0, sizeof(cs));
+	for (i = 0; i + vfs->fs_frag <= cgp->cg_ndblk; i += vfs->fs_frag) {
+		if (isblock(vfs, cg_blksfree(cgp), i / vfs->fs_frag)) {
+			cs.cs_nbfree++;
+			continue;
+		}
+		for (used = 0; used < vfs->fs_frag; used++)
+			if (isset(cg_blksfree(cgp), i + used))
+				cs.cs_nffree++;
+	}
+	for (; i < cgp->cg_ndblk; i++)
+		if (isset(cg_blksfree(cgp), i))
+			cs.cs_nffree++;
+	for (i = 0; i < vfs->fs_ipg; i++)
+		if (isclr(cg_inosused(cgp), i))
+			cs.cs_nifree++;
+	cs.cs_ndir = cgp->cg_cs.cs_ndir;
+	if (memcmp(&cs, &cgp->cg_cs, sizeof(cs)) != 0)
+		vcomplain("cg %d: counts do not match maps", cylno);
+	if (memcmp(&vcs[cylno], &cgp->cg_cs, sizeof(cs)) != 0)
+		vcomplain("cg %d: summary information does not match", cylno);
+	if (fscs != NULL && memcmp(&fscs[cylno], &cgp->cg_cs, sizeof(cs)) != 0)
+		vcomplain("cg %d: summary information in memory does not match",
+		    cylno);
+
+	/*
+	 * Every allocated inode must lie in an initialized inode block,
+	 * be in use and have a correct check-hash.
+	 */
+	if (vfs->fs_magic == FS_UFS1_MAGIC)
+		niblk = vfs->fs_ipg;
+	else
+		niblk = cgp->cg_initediblk;
+	if (niblk > vfs->fs_ipg) {
+		vcomplain("cg %d: bad initialized inode count %u", cylno, niblk);
+		return;
+	}
+	for (i = niblk; i < vfs->fs_ipg; i++)
+		if (isset(cg_inosused(cgp), i)) {
+			vcomplain("cg %d: inode %ju is beyond initialized inodes",
+			    cylno, (uintmax_t)cylno * vfs->fs_ipg + i);
+			break;
+		}
+	inosize = fragroundup(vfs, niblk * (vfs->fs_magic == FS_UFS1_MAGIC ?
+	    sizeof(*dp1) : sizeof(*dp2)));
+	if (inosize == 0)
+		return;
+	if (vread(cgimin(vfs, cylno), &buf[hdrsize], inosize) != 0) {
+		vcomplain("cg %d: cannot read inodes: %s", cylno,
+		    strerror(errno));
+		return;
+	}
+	dp1 = (struct ufs1_dinode *)&buf[hdrsize];
+	dp2 = (struct ufs2_dinode *)&buf[hdrsize];
+	for (i = 0; i < niblk; i++) {
+		mode = vfs->fs_magic == FS_UFS1_MAGIC ? dp1[i].di_mode :
+		    dp2[i].di_mode;
+		used = isset(cg_inosused(cgp), i);
+		if (mode != 0 && !used)
+			vcomplain("inode %ju: allocated but marked free",
+			    (uintmax_t)cylno * vfs->fs_ipg + i);
+		else if (mode == 0 && used && cylno * vfs->fs_ipg + i >=
+		    UFS_ROOTINO)
+			vcomplain("inode %ju: marked used but not allocated",
+			    (uintmax_t)cylno * vfs->fs_ipg + i);
+		if (mode == 0 || vfs->fs_magic == FS_UFS1_MAGIC ||
+		    (vfs->fs_metackhash & CK_INODE) == 0)
+			continue;
+		ckhash = dp2[i].di_ckhash;
+		dp2[i].di_ckhash = 0;
+		if (calculate_crc32c(~0L, (void *)&dp2[i], sizeof(*dp2)) !=
+		    ckhash)
+			vcomplain("inode %ju: check-hash is wrong",
+			    (uintmax_t)cylno * vfs->fs_ipg + i);
+	}
+	pthread_mutex_lock(&vlock);
+	vinodes += niblk;
+	pthread_mutex_unlock(&vlock);
+}
+
+static void *
+verifyworker(void *arg)
+{
+	char *buf;
+	int cylno;
+
+	buf = arg;
+	while ((cylno = __atomic_fetch_add(&vnextcg, 1, __ATOMIC_RELAXED)) <
+	    (int)vfs->fs_ncg)
+		verifycg(cylno, buf);
+	return (NULL);
+}
+
+/*
+ * Check the file system on d_name. Return the number of problems found.
+ */
+int
+fsverify(void)
+{
+	pthread_t threads[MAXVERIFYTHREADS];
+	char *bufs[MAXVERIFYTHREADS];
+	struct csum_total cstotal;
+	size_t bufsize, align;
+	long nthreads;
+	int i, error;
+
+	/*
+	 * Direct I/O needs buffers aligned to the logical block size of
+	 * the device, which a page is assumed to be a multiple of. Fall
+	 * back to buffered reads where direct I/O is not supported.
+	 */
+	align = MAX(sysconf(_SC_PAGESIZE), sblock.fs_fsize);
+	if ((vfs = aligned_alloc(align, SBLOCKSIZE)) == NULL)
+		errx(42, "aligned_alloc failed");
+	if (sparse.sp_open)
+		vfd = dup(d_fd);
+#ifdef O_DIRECT
+	if (vfd < 0)
+		vfd = open(d_name, O_RDONLY | O_DIRECT);
+	if (vfd >= 0 && dpread(vfd, vfs, SBLOCKSIZE, (off_t)part_ofs *
+	    sectorsize + sblock.fs_sblockloc) != SBLOCKSIZE) {
+		close(vfd);
+		vfd = -1;
+	}
+#endif
+	if (vfd < 0 && ((vfd = open(d_name, O_RDONLY)) < 0 ||
+	    dpread(vfd, vfs, SBLOCKSIZE, (off_t)part_ofs * sectorsize +
+	    sblock.fs_sblockloc) != SBLOCKSIZE))
+		err(1, "%s: cannot read superblock", d_name);
+	verrors = 0;
+	vinodes = 0;
+	vnextcg = 0;
+	if ((vfs->fs_magic != FS_UFS1_MAGIC && vfs->fs_magic != FS_UFS2_MAGIC) ||
+	    vfs->fs_sbsize > SBLOCKSIZE || vfs->fs_ncg < 1) {
+		printf("superblock: bad magic number\n");
+		return (1);
+	}
+	if ((vfs->fs_metackhash & CK_SUPERBLOCK) != 0 &&
+	    ffs_calc_sbhash(vfs) != vfs->fs_ckhash)
+		vcomplain("superblock: check-hash is wrong");
+
+	/*
+	 * Each thread has a buffer for the metadata of a cylinder group.
+	 */
+	bufsize = lfragtosize(vfs, vfs->fs_iblkno - vfs->fs_sblkno) +
+	    fragroundup(vfs, (size_t)vfs->fs_ipg *
+	    (vfs->fs_magic == FS_UFS1_MAGIC ? sizeof(struct ufs1_dinode) :
+	    sizeof(struct ufs2_dinode)));
+	bufsize = MAX(bufsize, (size_t)fragroundup(vfs, vfs->fs_cssize));
+	for (i = 0; i < MAXVERIFYTHREADS; i++)
+		bufs[i] = NULL;
+	if ((bufs[0] = aligned_alloc(align, bufsize)) == NULL)
+		errx(42, "aligned_alloc failed");
+	if (vread(vfs->fs_csaddr, bufs[0],
+	    fragroundup(vfs, vfs->fs_cssize)) != 0)
+		err(1, "%s: cannot read summary information", d_name);
+	if ((vcs = malloc(vfs->fs_cssize)) == NULL)
+		errx(42, "malloc failed");
+	memcpy(vcs, bufs[0], vfs->fs_cssize);
+	cssum(vcs, vfs->fs_ncg, &cstotal);
+	if (cstotal.cs_ndir != vfs->fs_cstotal.cs_ndir ||
+	    cstotal.cs_nbfree != vfs->fs_cstotal.cs_nbfree ||
+	    cstotal.cs_nifree != vfs->fs_cstotal.cs_nifree ||
+	    cstotal.cs_nffree != vfs->fs_cstotal.cs_nffree)
+		vcomplain("superblock: totals do not match summary information");
+
+	nthreads = ncpus();
+	nthreads = MAX(1, MIN(nthreads, MIN(MAXVERIFYTHREADS,
+	    (long)vfs->fs_ncg)));
+	for (i = 1; i < nthreads; i++)
+		if ((bufs[i] = aligned_alloc(align, bufsize)) == NULL)
+			errx(42, "aligned_alloc failed");
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, verifyworker,
+		    bufs[i])) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	verifyworker(bufs[0]);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	for (i = 0; i < nthreads; i++)
+		free(bufs[i]);
+	free(vcs);
+	free(vfs);
+	close(vfd);
+	vfd = -1;
+	printf("verified %d cylinder groups and %jd inodes: %d error%s\n",
+	    sblock.fs_ncg, (intmax_t)vinodes, verrors, verrors == 1 ? "" : "s");
+	return (verrors);
+}
@@ -0,0 +1,143 @@
+#!/bin/sh
+#
+# Drive the error paths of the writers of mkfs.ufs with --faults: failed,
+# short and slow writes, resuming a format that failed part way, and the
+# order of the summary area and the superblock through the plan, along
+# with images written through a mapping. Run it from the top of the tree
+# after "make", or with BIN set to the directory holding the programs.
+# It takes about ten seconds.
+#
+
+BIN=${BIN:-.}
+MKFS=$BIN/mkfs.ufs
+DUMPFS=$BIN/dumpfs.ufs
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+fails=0
+
+# Reproducible images, so that a resumed one can be compared with a
+# clean one, and one processor, so that cylinder groups are made in
+# small batches with checkpoints between them.
+SOURCE_DATE_EPOCH=1700000000
+export SOURCE_DATE_EPOCH
+PIN=
+if command -v taskset >/dev/null 2>&1; then
+	PIN="taskset -c 0"
+fi
+
+ok()
+{
+	if [ "$1" -eq 0 ]; then
+		echo "ok - $2"
+	else
+		echo "not ok - $2"
+		fails=$((fails + 1))
+	fi
+}
+
+# Run a command that is to fail with a message matching "$1".
+refused()
+{
+	pat=$1
+	shift
+	if "$@" >/dev/null 2>"$T/err"; then
+		return 1
+	fi
+	grep -q -e "$pat" "$T/err"
+}
+
+# A fresh image of 1g with small cylinder groups.
+OPTS="-b 4096 -f 512 --prefill 256"
+fresh()
+{
+	rm -f "$T/img"
+	truncate -s 1G "$T/img"
+}
+
+fresh
+$MKFS $OPTS "$T/img" >/dev/null && $DUMPFS "$T/img" >"$T/ref"
+ok $? "clean format"
+mv "$T/img" "$T/ref.img"
+
+# An image written through a mapping is the same as one written with
+# pwrite(2).
+fresh
+$MKFS $OPTS --mmap --verify "$T/img" >/dev/null
+ok $? "format through a mapping"
+cmp -s "$T/ref.img" "$T/img"
+ok $? "mapped image is the same as a written one"
+csaddr=$(awk '$1 == "fsize" { fsize = $2 }
+	$5 == "csaddr" { print $6 * fsize }' "$T/ref")
+
+# A write that fails leaves no file system behind.
+fresh
+echo "300m:100m eio 0" >"$T/faults"
+refused "write error to block device at byte 3" \
+    $MKFS $OPTS --faults "$T/faults" "$T/img"
+ok $? "EIO fails the format"
+refused "no usable superblock found" $DUMPFS "$T/img"
+ok $? "EIO leaves no superblock"
+
+# So does a short write, of a cylinder group or of the superblock.
+shortwrite()
+{
+	fresh
+	echo "$1" >"$T/faults"
+	refused "short write to block device at byte $2" \
+	    $MKFS $OPTS --faults "$T/faults" "$T/img"
+	ok $? "short write $1 fails the format"
+	refused "no usable superblock found" $DUMPFS "$T/img"
+	ok $? "short write $1 leaves no superblock"
+}
+shortwrite "300m:100m short=512 0" 3
+shortwrite "64k short=512" "65536:"
+
+# A format that fails after a checkpoint is resumed from it and ends up
+# byte for byte the same as one that did not fail. Writing 16m a second
+# makes the checkpoint come before the failure near the end.
+fresh
+echo "950m:70m eio 0" >"$T/faults"
+refused "write error to block device at byte 9" \
+    $PIN $MKFS $OPTS --max-rate 16m --faults "$T/faults" "$T/img"
+ok $? "EIO near the end fails the format"
+$MKFS $OPTS --resume "$T/img" >"$T/out" 2>&1
+ok $? "resumed format"
+grep -q "resuming at cylinder group [1-9]" "$T/out"
+ok $? "resumed from a checkpoint"
+cmp -s "$T/ref.img" "$T/img"
+ok $? "resumed image is the same as a clean one"
+rm -f "$T/ref.img"
+
+# Slow writes of the summary area do not let the superblock after it go
+# first: it is a later epoch of the plan, and written after the summary
+# area is done. The first superblock, marked bad, is an epoch of its own.
+fresh
+echo "$csaddr:4k delay=300 0" >"$T/faults"
+$MKFS $OPTS --faults "$T/faults" --plan "$T/plan" --trace "$T/trace" \
+    "$T/img" >/dev/null
+ok $? "format with slow summary writes"
+awk -v sb=65536 -v cs="$csaddr" '
+	{ n[$1]++ }
+	$2 <= sb && sb < $2 + $3 { if (!nsb++) sb1 = $1; sb2 = $1 }
+	$2 <= cs && cs < $2 + $3 { if (!ncs++) cs1 = $1; cs2 = $1 }
+	END { exit !(nsb && ncs && cs1 < sb1 && cs2 < sb2 && n[sb1] == 1) }' \
+    "$T/plan"
+ok $? "summary area and superblocks in their own epochs"
+# The numbers of a pwritev event are its pid, tid, ts, dur, offset and size.
+grep '"name":"pwritev"' "$T/trace" | tr -c '0-9.\n' ' ' |
+    awk '{ print $3, $4, $5, $6 }' | sort -n | awk -v sb=65536 -v cs="$csaddr" '
+	$3 <= sb && sb < $3 + $4 { sbstart = $1 }
+	$3 <= cs && cs < $3 + $4 { csend = $1 + $2 }
+	END { exit !(sbstart > 0 && sbstart >= csend) }'
+ok $? "superblock written after the summary area"
+
+# Faults are only injected into writes to the device.
+echo "64k eio" >"$T/faults"
+refused "--faults is not usable with --sparse or --mmap" \
+    $MKFS --faults "$T/faults" --mmap "$T/img"
+ok $? "--faults refused with --mmap"
+refused "--faults is not usable with --sparse or --mmap" \
+    $MKFS --faults "$T/faults" --sparse 1g "$T/sparse"
+ok $? "--faults refused with --sparse"
+
+[ $fails -eq 0 ]
@@ -0,0 +1,67 @@
+#!/bin/sh
+#
+# Make a file system in the FreeBSD UFS partition of a GPT disk image,
+# in one pass and without a loop device, and check that it verifies and
+# that the partition table and the partition before it are left alone.
+# Run it from the top of the tree after "make", or with BIN set to the
+# directory holding the programs.
+#
+
+BIN=${BIN:-.}
+MKFS=$BIN/mkfs.ufs
+DUMPFS=$BIN/dumpfs.ufs
+T=$(mktemp -d) || exit 1
+trap 'rm -rf "$T"' EXIT
+fails=0
+
+ok()
+{
+	if [ "$1" -eq 0 ]; then
+		echo "ok - $2"
+	else
+		echo "not ok - $2"
+		fails=$((fails + 1))
+	fi
+}
+
+put()
+{
+	printf "$2" | dd of="$T/disk" bs=1 seek="$1" conv=notrunc status=none
+}
+
+# A 64m disk of 131072 sectors with a protective MBR and a GPT of two
+# partitions: a Linux one at sectors 40-2087 and a FreeBSD UFS one from
+# sector 2088 to the last usable sector, 131038.
+truncate -s 64M "$T/disk"
+put 446 '\000\000\002\000\356\377\377\377\001\000\000\000\377\377\001\000'
+put 510 '\125\252EFI PART\000\000\001\000\134\000\000\000\300\071\357\015'
+put 532 '\000\000\000\000\001\000\000\000\000\000\000\000\377\377\001\000'
+put 548 '\000\000\000\000\042\000\000\000\000\000\000\000\336\377\001\000'
+put 564 '\000\000\000\000\041\042\043\044\045\046\047\050\051\052\053\054'
+put 580 '\055\056\057\060\002\000\000\000\000\000\000\000\200\000\000\000'
+put 596 '\200\000\000\000\261\003\300\167'
+put 1024 '\257\075\306\017\203\204\162\107\216\171\075\151\330\107\175\344'
+put 1040 '\001\002\003\004\005\006\007\010\011\012\013\014\015\016\017\020'
+put 1056 '\050\000\000\000\000\000\000\000\047\010\000\000\000\000\000\000'
+put 1080 'd\000a\000t\000a\000'
+put 1152 '\266\174\156\121\317\156\326\021\217\370\000\002\055\011\161\053'
+put 1168 '\021\022\023\024\025\026\027\030\031\032\033\034\035\036\037\040'
+put 1184 '\050\010\000\000\000\000\000\000\336\377\001\000\000\000\000\000'
+put 1208 'r\000o\000o\000t\000'
+dd if="$T/disk" of="$T/gpt" bs=512 count=2088 status=none
+
+for m in "" --mmap; do
+	$MKFS --partition ufs --verify $m "$T/disk" >"$T/out" 2>&1
+	ok $? "format of the UFS partition $m"
+	grep -q "using 128951 sectors from sector 2088" "$T/out"
+	ok $? "found the UFS partition $m"
+	grep -q "0 errors" "$T/out"
+	ok $? "verified the file system $m"
+	dd if="$T/disk" bs=512 count=2088 status=none | cmp -s "$T/gpt" -
+	ok $? "partition table and first partition left alone $m"
+	dd if="$T/disk" of="$T/part" bs=512 skip=2088 status=none
+	$DUMPFS "$T/part" >/dev/null
+	ok $? "file system at the start of the partition $m"
+done
+
+[ $fails -eq 0 ]